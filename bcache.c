@@ -0,0 +1,329 @@
+// Sharded 2Q block cache over pread/pwrite, see bcache.h.
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bcache.h"
+#include "blocks.h"
+
+#define BCACHE_SHARDS 8
+
+enum { BCACHE_A1IN, BCACHE_AM, BCACHE_PINNED, BCACHE_DROPPED };
+
+// The block's data follows the entry, so bcache_put finds the entry from it.
+typedef struct bcache_entry {
+  int bnum;
+  int queue; // BCACHE_A1IN, BCACHE_AM, BCACHE_PINNED or BCACHE_DROPPED
+  int pins;  // bcache_get calls not matched by bcache_put yet
+  int dirty; // changed since last read or written back
+  struct bcache_entry *prev, *next;
+  uint8_t *data;
+} bcache_entry_t;
+
+typedef struct bcache_list {
+  bcache_entry_t *head, *tail; // most recent first
+  int count;
+} bcache_list_t;
+
+typedef struct bcache_shard {
+  pthread_mutex_t lock;
+  bcache_list_t a1in; // seen once, FIFO
+  bcache_list_t am;   // seen again after leaving a1in, LRU
+  int capacity;       // of a1in and am together
+  int kin;            // a1in gets evicted from first once longer than this
+  int *ghosts;        // A1out: numbers of blocks evicted from a1in, a ring
+  int ghost_max, ghost_first, ghost_count;
+  bcache_stats_t stats;
+} bcache_shard_t;
+
+static int bcache_fd = -1;
+static int bcache_nblocks = 0;
+static bcache_entry_t **bcache_map = 0; // by block number, 0 if not cached
+static int *bcache_ghost = 0;          // by block number, times it is in A1out
+static bcache_shard_t bcache_shards[BCACHE_SHARDS];
+
+static bcache_shard_t *bcache_shard(int bnum) {
+  return &bcache_shards[bnum % BCACHE_SHARDS];
+}
+
+static void bcache_unlink(bcache_list_t *list, bcache_entry_t *entry) {
+  if (entry->prev) {
+    entry->prev->next = entry->next;
+  } else {
+    list->head = entry->next;
+  }
+  if (entry->next) {
+    entry->next->prev = entry->prev;
+  } else {
+    list->tail = entry->prev;
+  }
+  list->count--;
+}
+
+static void bcache_push(bcache_list_t *list, bcache_entry_t *entry) {
+  entry->prev = 0;
+  entry->next = list->head;
+  if (list->head) {
+    list->head->prev = entry;
+  } else {
+    list->tail = entry;
+  }
+  list->head = entry;
+  list->count++;
+}
+
+// Take an entry out of whichever queue it is on.
+static void bcache_dequeue(bcache_shard_t *shard, bcache_entry_t *entry) {
+  if (entry->queue == BCACHE_A1IN) {
+    bcache_unlink(&shard->a1in, entry);
+  } else if (entry->queue == BCACHE_AM) {
+    bcache_unlink(&shard->am, entry);
+  } else {
+    shard->stats.pinned--;
+  }
+}
+
+// Remember a block evicted from a1in, forgetting the oldest one if full.
+static void bcache_add_ghost(bcache_shard_t *shard, int bnum) {
+  if (shard->ghost_count == shard->ghost_max) {
+    bcache_ghost[shard->ghosts[shard->ghost_first]]--;
+    shard->ghost_first = (shard->ghost_first + 1) % shard->ghost_max;
+    shard->ghost_count--;
+  }
+
+  int last = (shard->ghost_first + shard->ghost_count) % shard->ghost_max;
+  shard->ghosts[last] = bnum;
+  shard->ghost_count++;
+  bcache_ghost[bnum]++;
+}
+
+// Write a dirty block back.
+static void bcache_writeback(bcache_shard_t *shard, bcache_entry_t *entry) {
+  if (entry->dirty) {
+    ssize_t rv = pwrite(bcache_fd, entry->data, BLOCK_SIZE,
+                        (off_t) entry->bnum * BLOCK_SIZE);
+    assert(rv == BLOCK_SIZE);
+    entry->dirty = 0;
+    shard->stats.writebacks++;
+  }
+}
+
+// Whether the shard holds as many blocks as it may, pinned ones included,
+// and has one it could evict. Pinned blocks can push it over capacity for
+// as long as they are pinned.
+static int bcache_full(bcache_shard_t *shard) {
+  int count = shard->a1in.count + shard->am.count;
+  return count > 0 && count + (int) shard->stats.pinned >= shard->capacity;
+}
+
+// Make room for one more block: a1in gives up its oldest block while it is
+// over its share, otherwise am gives up its least recently used one.
+static bcache_entry_t *bcache_evict(bcache_shard_t *shard) {
+  bcache_entry_t *victim;
+
+  if (shard->a1in.count > shard->kin || shard->am.count == 0) {
+    victim = shard->a1in.tail;
+    bcache_unlink(&shard->a1in, victim);
+    bcache_add_ghost(shard, victim->bnum);
+  } else {
+    victim = shard->am.tail;
+    bcache_unlink(&shard->am, victim);
+  }
+
+  bcache_writeback(shard, victim);
+  bcache_map[victim->bnum] = 0;
+  shard->stats.evictions++;
+  return victim;
+}
+
+// Look a block up, reading it in on a miss. Called with the shard locked.
+static bcache_entry_t *bcache_lookup(bcache_shard_t *shard, int bnum) {
+  bcache_entry_t *entry = bcache_map[bnum];
+
+  if (entry) {
+    shard->stats.hits++;
+    // A block in a1in stays where it is: a second access soon after the
+    // first says nothing about whether it will be wanted later
+    if (entry->queue == BCACHE_AM) {
+      bcache_unlink(&shard->am, entry);
+      bcache_push(&shard->am, entry);
+    }
+    return entry;
+  }
+
+  shard->stats.misses++;
+  if (bcache_full(shard)) {
+    entry = bcache_evict(shard);
+  } else {
+    entry = malloc(sizeof(bcache_entry_t) + BLOCK_SIZE);
+    assert(entry);
+    entry->data = (uint8_t *) (entry + 1);
+  }
+
+  ssize_t rv = pread(bcache_fd, entry->data, BLOCK_SIZE, (off_t) bnum * BLOCK_SIZE);
+  assert(rv >= 0);
+  memset(entry->data + rv, 0, BLOCK_SIZE - rv);
+
+  entry->bnum = bnum;
+  entry->pins = 0;
+  entry->dirty = 0;
+  if (bcache_ghost[bnum]) {
+    entry->queue = BCACHE_AM;
+    bcache_push(&shard->am, entry);
+  } else {
+    entry->queue = BCACHE_A1IN;
+    bcache_push(&shard->a1in, entry);
+  }
+  bcache_map[bnum] = entry;
+  return entry;
+}
+
+// Set up the cache over the given image file.
+void bcache_init(int fd, int nblocks, int capacity) {
+  bcache_fd = fd;
+  bcache_nblocks = nblocks;
+  bcache_map = calloc(nblocks, sizeof(bcache_entry_t *));
+  bcache_ghost = calloc(nblocks, sizeof(int));
+  assert(bcache_map && bcache_ghost);
+
+  for (int i = 0; i < BCACHE_SHARDS; ++i) {
+    bcache_shard_t *shard = &bcache_shards[i];
+
+    memset(shard, 0, sizeof(bcache_shard_t));
+    pthread_mutex_init(&shard->lock, 0);
+    // The 2Q paper's tuning: a1in a quarter, A1out half of the capacity
+    shard->capacity = capacity / BCACHE_SHARDS > 1 ? capacity / BCACHE_SHARDS : 2;
+    shard->kin = shard->capacity / 4 > 1 ? shard->capacity / 4 : 1;
+    shard->ghost_max = shard->capacity / 2 > 1 ? shard->capacity / 2 : 1;
+    shard->ghosts = malloc(shard->ghost_max * sizeof(int));
+    assert(shard->ghosts);
+  }
+}
+
+// Get a block and pin it.
+void *bcache_get(int bnum) {
+  bcache_shard_t *shard = bcache_shard(bnum);
+
+  pthread_mutex_lock(&shard->lock);
+  bcache_entry_t *entry = bcache_lookup(shard, bnum);
+  if (entry->queue != BCACHE_PINNED) {
+    bcache_dequeue(shard, entry);
+    entry->queue = BCACHE_PINNED;
+    shard->stats.pinned++;
+  }
+  entry->pins++;
+  pthread_mutex_unlock(&shard->lock);
+
+  return entry->data;
+}
+
+// Unpin a block got with bcache_get.
+void bcache_put(void *data, int dirty) {
+  bcache_entry_t *entry = (bcache_entry_t *) data - 1;
+  bcache_shard_t *shard = bcache_shard(entry->bnum);
+
+  pthread_mutex_lock(&shard->lock);
+  if (entry->queue == BCACHE_DROPPED) {
+    // Freed while pinned; only the memory is left
+    if (--entry->pins == 0) {
+      free(entry);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return;
+  }
+
+  entry->dirty |= dirty;
+  if (--entry->pins == 0) {
+    // Wanted more than once by definition, so on to the LRU
+    shard->stats.pinned--;
+    entry->queue = BCACHE_AM;
+    bcache_push(&shard->am, entry);
+
+    // Back to capacity, now that there is something to evict again
+    while (shard->a1in.count + shard->am.count + (int) shard->stats.pinned >
+           shard->capacity) {
+      free(bcache_evict(shard));
+    }
+  }
+  pthread_mutex_unlock(&shard->lock);
+}
+
+// Copy part of a block out of the cache.
+void bcache_read(int bnum, int offset, void *buf, int size) {
+  bcache_shard_t *shard = bcache_shard(bnum);
+
+  pthread_mutex_lock(&shard->lock);
+  memcpy(buf, bcache_lookup(shard, bnum)->data + offset, size);
+  pthread_mutex_unlock(&shard->lock);
+}
+
+// Copy data into part of a block in the cache.
+void bcache_write(int bnum, int offset, const void *buf, int size) {
+  bcache_shard_t *shard = bcache_shard(bnum);
+
+  pthread_mutex_lock(&shard->lock);
+  bcache_entry_t *entry = bcache_lookup(shard, bnum);
+  memcpy(entry->data + offset, buf, size);
+  entry->dirty = 1;
+  pthread_mutex_unlock(&shard->lock);
+}
+
+// Write a block back if it is cached and dirty.
+void bcache_sync(int bnum) {
+  bcache_shard_t *shard = bcache_shard(bnum);
+
+  pthread_mutex_lock(&shard->lock);
+  if (bcache_map[bnum]) {
+    bcache_writeback(shard, bcache_map[bnum]);
+  }
+  pthread_mutex_unlock(&shard->lock);
+}
+
+// Forget a block without writing it back.
+void bcache_drop(int bnum) {
+  bcache_shard_t *shard = bcache_shard(bnum);
+
+  pthread_mutex_lock(&shard->lock);
+  bcache_entry_t *entry = bcache_map[bnum];
+  if (entry) {
+    bcache_dequeue(shard, entry);
+    bcache_map[bnum] = 0;
+    if (entry->pins > 0) {
+      // Someone still has the pointer; the last bcache_put frees it
+      entry->queue = BCACHE_DROPPED;
+    } else {
+      free(entry);
+    }
+  }
+  pthread_mutex_unlock(&shard->lock);
+}
+
+// Write back every cached block that is dirty.
+void bcache_flush() {
+  for (int bnum = 0; bnum < bcache_nblocks; ++bnum) {
+    bcache_sync(bnum);
+  }
+}
+
+// Add up the counters of all shards.
+void bcache_get_stats(bcache_stats_t *stats) {
+  memset(stats, 0, sizeof(bcache_stats_t));
+
+  for (int i = 0; i < BCACHE_SHARDS; ++i) {
+    bcache_shard_t *shard = &bcache_shards[i];
+
+    pthread_mutex_lock(&shard->lock);
+    stats->hits += shard->stats.hits;
+    stats->misses += shard->stats.misses;
+    stats->evictions += shard->stats.evictions;
+    stats->writebacks += shard->stats.writebacks;
+    stats->cached += shard->a1in.count + shard->am.count;
+    stats->pinned += shard->stats.pinned;
+    pthread_mutex_unlock(&shard->lock);
+  }
+}
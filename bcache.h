@@ -0,0 +1,107 @@
+// Block cache for running on the image file with pread/pwrite instead of a
+// mapping (blocks.c built with -DNUFS_BCACHE).
+//
+// Blocks are spread over shards by number, each with its own lock and its
+// own share of the capacity. Eviction is 2Q: a block read for the first time
+// goes on a FIFO, and only a block asked for again after dropping off that
+// FIFO gets into the LRU of hot blocks, so one long sequential read only
+// churns the FIFO. Blocks pinned by bcache_get (metadata) are kept out of
+// both queues until bcache_put, but count against the capacity.
+//
+// Each block has a dirty flag, set by bcache_write and by bcache_put for
+// blocks written through their pointer, and only dirty blocks are written
+// back.
+
+#ifndef BCACHE_H
+#define BCACHE_H
+
+#include <stdint.h>
+
+// Blocks the cache holds at most, unless set at compile time
+#ifndef NUFS_BCACHE_BLOCKS
+#define NUFS_BCACHE_BLOCKS 64
+#endif
+
+typedef struct bcache_stats {
+  uint64_t hits;       // lookups that found the block cached
+  uint64_t misses;     // lookups that had to read the block
+  uint64_t evictions;  // blocks dropped to make room
+  uint64_t writebacks; // changed blocks written to the image
+  uint32_t cached;     // blocks in the queues now
+  uint32_t pinned;     // pinned blocks now
+} bcache_stats_t;
+
+/**
+ * Set up the cache over the given image file.
+ *
+ * @param fd The open image file.
+ * @param nblocks Number of blocks in the image.
+ * @param capacity Number of blocks to keep at most.
+ */
+void bcache_init(int fd, int nblocks, int capacity);
+
+/**
+ * Get a block and pin it, so that the pointer stays valid until it is put
+ * back with bcache_put. Pins nest.
+ *
+ * @param bnum Block number.
+ * @return Pointer to the cached copy of the block.
+ */
+void *bcache_get(int bnum);
+
+/**
+ * Unpin a block got with bcache_get.
+ *
+ * @param data The pointer bcache_get returned.
+ * @param dirty Nonzero if the block was written through the pointer.
+ */
+void bcache_put(void *data, int dirty);
+
+/**
+ * Copy part of a block out of the cache, reading it in if needed.
+ *
+ * @param bnum Block number.
+ * @param offset Offset in the block.
+ * @param buf Where to copy to.
+ * @param size Number of bytes, up to the end of the block.
+ */
+void bcache_read(int bnum, int offset, void *buf, int size);
+
+/**
+ * Copy data into part of a block in the cache, reading it in if needed.
+ *
+ * @param bnum Block number.
+ * @param offset Offset in the block.
+ * @param buf Where to copy from.
+ * @param size Number of bytes, up to the end of the block.
+ */
+void bcache_write(int bnum, int offset, const void *buf, int size);
+
+/**
+ * Write a block back to the image if it is cached and dirty.
+ *
+ * @param bnum Block number.
+ */
+void bcache_sync(int bnum);
+
+/**
+ * Forget a block without writing it back, pinned or not. A pinned block's
+ * memory stays valid until it is put back.
+ *
+ * @param bnum Block number.
+ */
+void bcache_drop(int bnum);
+
+/**
+ * Write back every cached block that is dirty.
+ */
+void bcache_flush();
+
+/**
+ * Add up the counters of all shards.
+ *
+ * @param stats Filled in with the totals.
+ */
+void bcache_get_stats(bcache_stats_t *stats);
+
+#endif
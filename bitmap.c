@@ -34,6 +34,32 @@ void bitmap_put(void *bm, int i, int v) {
   }
 }
 
+// Find the first clear bit at or after the given index, a byte at a time.
+int bitmap_find_zero(void *bm, int from, int size) {
+  uint8_t *base = (uint8_t *) bm;
+
+  for (int i = from; i < size; i += 8 - bit_index(i)) {
+    uint8_t clear = ~base[byte_index(i)] & (0xff << bit_index(i));
+
+    if (clear) {
+      int bit = i - bit_index(i) + __builtin_ctz(clear);
+      return bit < size ? bit : -1;
+    }
+  }
+
+  return -1;
+}
+
+// Clear every bit of the bitmap that is set in the mask.
+void bitmap_clear_mask(void *bm, const void *mask, int size) {
+  uint8_t *base = (uint8_t *) bm;
+  const uint8_t *clear = (const uint8_t *) mask;
+
+  for (int i = 0; i < byte_index(size + 7); i++) {
+    base[i] &= ~clear[i];
+  }
+}
+
 // Pretty-print the bitmap (with the given no. of bits).
 void bitmap_print(void *bm, int size) {
 
@@ -26,6 +26,25 @@ int bitmap_get(void *bm, int i);
  */
 void bitmap_put(void *bm, int i, int v);
 
+/**
+ * Find the first clear bit of a bitmap.
+ *
+ * @param bm Pointer to the start of the bitmap.
+ * @param from Index of the first bit to look at.
+ * @param size The number of bits in the bitmap.
+ * @return The index of the first clear bit at or after from, or -1.
+ */
+int bitmap_find_zero(void *bm, int from, int size);
+
+/**
+ * Clear every bit of the bitmap that is set in the mask.
+ *
+ * @param bm Pointer to the start of the bitmap.
+ * @param mask Pointer to a bitmap of the bits to clear.
+ * @param size The number of bits in both bitmaps.
+ */
+void bitmap_clear_mask(void *bm, const void *mask, int size);
+
 /**
  * Pretty-print a bitmap. 
  *
@@ -10,15 +10,19 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "bcache.h"
 #include "bitmap.h"
 #include "blocks.h"
+#include "copy.h"
 
 const int BLOCK_COUNT = 256; // we split the "disk" into 256 blocks
 const int BLOCK_SIZE = 4096; // = 4K
@@ -30,6 +34,33 @@ const int BLOCK_BITMAP_SIZE = BLOCK_COUNT / 8;
 static int blocks_fd = -1;
 static void *blocks_base = 0;
 
+#ifdef NUFS_BCACHE
+// Blocks 0 to 3 hold the bitmaps and the inode table, which may run from one
+// block into the next, so they are read into one buffer and kept there. The
+// other blocks go through the block cache.
+#define BLOCKS_META 4
+
+// Cached blocks this thread has pinned since it last put them back, each
+// once. The key frees the list when the thread exits.
+static pthread_key_t blocks_held_key;
+static __thread void **blocks_held = 0;
+static __thread int blocks_held_count = 0;
+static __thread int blocks_held_max = 0;
+#endif
+
+// Free blocks held back for inodes' preallocation windows, which
+// alloc_block leaves alone until nothing else is free. In memory only.
+static uint8_t *blocks_reserved = 0;
+
+// One lock per allocation group, over its bits of the block bitmap and of
+// blocks_reserved; and one over the inode bitmap
+static pthread_mutex_t *blocks_group_locks = 0;
+static pthread_mutex_t blocks_inode_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Blocks and inodes freed during this thread's batch, or 0 outside of one
+static __thread uint8_t *batch_blocks = 0;
+static __thread uint8_t *batch_inodes = 0;
+
 // Get the number of blocks needed to store the given number of bytes.
 int bytes_to_blocks(int bytes) {
   int quo = bytes / BLOCK_SIZE;
@@ -50,24 +81,202 @@ void blocks_init(const char *image_path) {
   int rv = ftruncate(blocks_fd, NUFS_SIZE);
   assert(rv == 0);
 
+#ifdef NUFS_BCACHE
+  blocks_base = malloc(BLOCKS_META * BLOCK_SIZE);
+  assert(blocks_base);
+  rv = pread(blocks_fd, blocks_base, BLOCKS_META * BLOCK_SIZE, 0);
+  assert(rv == BLOCKS_META * BLOCK_SIZE);
+  bcache_init(blocks_fd, BLOCK_COUNT, NUFS_BCACHE_BLOCKS);
+  rv = pthread_key_create(&blocks_held_key, free);
+  assert(rv == 0);
+#else
   // map the image to memory
   blocks_base =
       mmap(0, NUFS_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, blocks_fd, 0);
   assert(blocks_base != MAP_FAILED);
+#endif
+
+  blocks_reserved = calloc(BLOCK_BITMAP_SIZE, 1);
+  blocks_group_locks =
+      malloc(BLOCK_COUNT / BLOCKS_GROUP_SIZE * sizeof(pthread_mutex_t));
+  assert(blocks_reserved && blocks_group_locks);
+  for (int group = 0; group < BLOCK_COUNT / BLOCKS_GROUP_SIZE; ++group) {
+    pthread_mutex_init(&blocks_group_locks[group], 0);
+  }
 
   // block 0 stores the block bitmap and the inode bitmap
   void *bbm = get_blocks_bitmap();
   bitmap_put(bbm, 0, 1);
 }
 
+// Lock the allocation group of the given block.
+static void blocks_lock_group(int bnum) {
+  pthread_mutex_lock(&blocks_group_locks[bnum / BLOCKS_GROUP_SIZE]);
+}
+
+static void blocks_unlock_group(int bnum) {
+  pthread_mutex_unlock(&blocks_group_locks[bnum / BLOCKS_GROUP_SIZE]);
+}
+
 // Close the disk image.
 void blocks_free() {
+#ifdef NUFS_BCACHE
+  blocks_sync();
+  free(blocks_base);
+#else
   int rv = munmap(blocks_base, NUFS_SIZE);
   assert(rv == 0);
+#endif
 }
 
 // Get the given block, returning a pointer to its start.
-void *blocks_get_block(int bnum) { return blocks_base + BLOCK_SIZE * bnum; }
+void *blocks_get_block(int bnum) {
+#ifdef NUFS_BCACHE
+  if (bnum >= BLOCKS_META) {
+    void *block = bcache_get(bnum);
+    for (int ii = 0; ii < blocks_held_count; ++ii) {
+      if (blocks_held[ii] == block) {
+        bcache_put(block, 0);
+        return block;
+      }
+    }
+    if (blocks_held_count == blocks_held_max) {
+      blocks_held_max = blocks_held_max ? 2 * blocks_held_max : 16;
+      blocks_held = realloc(blocks_held, blocks_held_max * sizeof(void *));
+      assert(blocks_held);
+      pthread_setspecific(blocks_held_key, blocks_held);
+    }
+    blocks_held[blocks_held_count++] = block;
+    return block;
+  }
+#endif
+  return blocks_base + BLOCK_SIZE * bnum;
+}
+
+// Put back the blocks this thread got since it last did.
+void blocks_put_held(int dirty) {
+#ifdef NUFS_BCACHE
+  for (int ii = 0; ii < blocks_held_count; ++ii) {
+    bcache_put(blocks_held[ii], dirty);
+  }
+  blocks_held_count = 0;
+#endif
+}
+
+// Copy bytes out of the image.
+void blocks_read(off_t pos, void *buf, size_t size) {
+#ifdef NUFS_BCACHE
+  for (size_t done = 0; done < size;) {
+    int offset = (pos + done) % BLOCK_SIZE;
+    size_t chunk = BLOCK_SIZE - offset < size - done ? BLOCK_SIZE - offset
+                                                     : size - done;
+    bcache_read((pos + done) / BLOCK_SIZE, offset, (char *) buf + done, chunk);
+    done += chunk;
+  }
+#else
+  copy_data(buf, blocks_base + pos, size);
+#endif
+}
+
+// Copy bytes into the image.
+void blocks_write(off_t pos, const void *buf, size_t size) {
+#ifdef NUFS_BCACHE
+  for (size_t done = 0; done < size;) {
+    int offset = (pos + done) % BLOCK_SIZE;
+    size_t chunk = BLOCK_SIZE - offset < size - done ? BLOCK_SIZE - offset
+                                                     : size - done;
+    bcache_write((pos + done) / BLOCK_SIZE, offset, (const char *) buf + done,
+                 chunk);
+    done += chunk;
+  }
+#else
+  copy_data(blocks_base + pos, buf, size);
+#endif
+}
+
+// Zero bytes of the image.
+void blocks_zero(off_t pos, size_t size) {
+#ifdef NUFS_BCACHE
+  static char zeros[4096];
+  for (size_t done = 0; done < size;) {
+    int offset = (pos + done) % BLOCK_SIZE;
+    size_t chunk = BLOCK_SIZE - offset < size - done ? BLOCK_SIZE - offset
+                                                     : size - done;
+    bcache_write((pos + done) / BLOCK_SIZE, offset, zeros, chunk);
+    done += chunk;
+  }
+#else
+  memset(blocks_base + pos, 0, size);
+#endif
+}
+
+// Write back what the image file does not have yet; with the mapping, the
+// kernel does that.
+void blocks_sync() {
+#ifdef NUFS_BCACHE
+  ssize_t rv = pwrite(blocks_fd, blocks_base, BLOCKS_META * BLOCK_SIZE, 0);
+  assert(rv == BLOCKS_META * BLOCK_SIZE);
+  bcache_flush();
+#endif
+}
+
+// Write everything back, then have the kernel put it on disk; the mapping
+// needs an msync for that, the descriptor an fsync.
+int blocks_fsync(int datasync) {
+  blocks_sync();
+#ifndef NUFS_BCACHE
+  if (msync(blocks_base, NUFS_SIZE, MS_SYNC) < 0) {
+    return -errno;
+  }
+#endif
+  int rv = datasync ? fdatasync(blocks_fd) : fsync(blocks_fd);
+  return rv < 0 ? -errno : 0;
+}
+
+// Make the image file up to date for a range about to be read or written
+// through the descriptor.
+void blocks_sync_range(off_t pos, size_t size) {
+#ifdef NUFS_BCACHE
+  for (off_t bnum = pos / BLOCK_SIZE; bnum * BLOCK_SIZE < pos + size; ++bnum) {
+    bcache_sync(bnum);
+  }
+#endif
+}
+
+// Forget cached copies of a range written through the descriptor.
+void blocks_invalidate_range(off_t pos, size_t size) {
+#ifdef NUFS_BCACHE
+  for (off_t bnum = pos / BLOCK_SIZE; bnum * BLOCK_SIZE < pos + size; ++bnum) {
+    bcache_drop(bnum);
+  }
+#endif
+}
+
+// Get the counters of the block cache.
+int blocks_cache_stats(bcache_stats_t *stats) {
+#ifdef NUFS_BCACHE
+  bcache_get_stats(stats);
+  return 0;
+#else
+  return -ENOTTY;
+#endif
+}
+
+// Get the file descriptor of the disk image.
+int blocks_get_fd() { return blocks_fd; }
+
+// Start paging in part of the image; the kernel reads it asynchronously.
+void blocks_prefetch(off_t pos, size_t size) {
+#ifdef NUFS_BCACHE
+  // Only into the page cache: a sequential reader would push everything out
+  // of the block cache's FIFO before getting to it anyway
+  posix_fadvise(blocks_fd, pos, size, POSIX_FADV_WILLNEED);
+#else
+  // madvise wants a page-aligned start
+  off_t start = pos - pos % BLOCK_SIZE;
+  madvise(blocks_base + start, size + (pos - start), MADV_WILLNEED);
+#endif
+}
 
 // Return a pointer to the beginning of the block bitmap.
 // The size is BLOCK_BITMAP_SIZE bytes.
@@ -81,24 +290,207 @@ void *get_inode_bitmap() {
   return (void *) (block + BLOCK_BITMAP_SIZE);
 }
 
+// Find a free block in the allocation group starting at the given block,
+// which the caller has locked; reserved blocks only if steal is set.
+static int blocks_find_free(int start, int steal) {
+  void *bbm = get_blocks_bitmap();
+  int end = start - start % BLOCKS_GROUP_SIZE + BLOCKS_GROUP_SIZE;
+  int ii = bitmap_find_zero(bbm, start, end);
+
+  while (ii >= 0 && !steal && bitmap_get(blocks_reserved, ii)) {
+    ii = bitmap_find_zero(bbm, ii + 1, end);
+  }
+  return ii;
+}
+
 // Allocate a new block and return its index.
 int alloc_block() {
   void *bbm = get_blocks_bitmap();
 
-  for (int ii = 1; ii < BLOCK_COUNT; ++ii) {
-    if (!bitmap_get(bbm, ii)) {
-      bitmap_put(bbm, ii, 1);
-      printf("+ alloc_block() -> %d\n", ii);
-      return ii;
+  // If the disk is full otherwise, take a block back from a window
+  for (int steal = 0; steal < 2; ++steal) {
+    for (int start = 0; start < BLOCK_COUNT; start += BLOCKS_GROUP_SIZE) {
+      blocks_lock_group(start);
+      int ii = blocks_find_free(start ? start : 1, steal);
+      if (ii >= 0) {
+        bitmap_put(blocks_reserved, ii, 0);
+        bitmap_put(bbm, ii, 1);
+      }
+      blocks_unlock_group(start);
+
+      if (ii >= 0) {
+        printf("+ alloc_block() -> %d\n", ii);
+        return ii;
+      }
     }
   }
 
   return -1;
 }
 
+// Reserve up to count free blocks in a row from start on, within its
+// allocation group, which the caller has locked.
+static int blocks_reserve_run(int start, int count) {
+  uint8_t *bbm = get_blocks_bitmap();
+  int end = start - start % BLOCKS_GROUP_SIZE + BLOCKS_GROUP_SIZE;
+  int reserved = 0;
+
+  while (reserved < count && start + reserved < end &&
+         !bitmap_get(bbm, start + reserved) &&
+         !bitmap_get(blocks_reserved, start + reserved)) {
+    bitmap_put(blocks_reserved, start + reserved, 1);
+    ++reserved;
+  }
+  return reserved;
+}
+
+// Reserve up to count free blocks in a row, right after the given block if
+// it is followed by a free one, else at the first free block. A window
+// never spans two allocation groups.
+int blocks_reserve(int after, int count, int *first) {
+  uint8_t *bbm = get_blocks_bitmap();
+  int bytes = BLOCKS_GROUP_SIZE / 8;
+
+  // Windows get smaller as the disk fills up: one never takes more than a
+  // quarter of the blocks nobody has a claim on
+  int available = 0;
+  for (int start = 0; start < BLOCK_COUNT; start += BLOCKS_GROUP_SIZE) {
+    blocks_lock_group(start);
+    for (int i = start / 8; i < start / 8 + bytes; ++i) {
+      available += __builtin_popcount((uint8_t) ~(bbm[i] | blocks_reserved[i]));
+    }
+    blocks_unlock_group(start);
+  }
+  if (count > available / 4) {
+    count = available / 4;
+  }
+  if (count == 0) {
+    return 0;
+  }
+
+  int start = after + 1;
+  int reserved = 0;
+  if (start < BLOCK_COUNT) {
+    blocks_lock_group(start);
+    reserved = blocks_reserve_run(start, count);
+    blocks_unlock_group(start);
+  }
+
+  for (int group = 0; reserved == 0 && group < BLOCK_COUNT;
+       group += BLOCKS_GROUP_SIZE) {
+    blocks_lock_group(group);
+    start = blocks_find_free(group ? group : 1, 0);
+    if (start >= 0) {
+      reserved = blocks_reserve_run(start, count);
+    }
+    blocks_unlock_group(group);
+  }
+
+  *first = start;
+  return reserved;
+}
+
+// Allocate a reserved block, if it is still reserved.
+int blocks_claim(int bnum) {
+  int claimed = 0;
+
+  blocks_lock_group(bnum);
+  if (bitmap_get(blocks_reserved, bnum)) {
+    bitmap_put(blocks_reserved, bnum, 0);
+    bitmap_put(get_blocks_bitmap(), bnum, 1);
+    claimed = 1;
+  }
+  blocks_unlock_group(bnum);
+
+  if (claimed) {
+    printf("+ blocks_claim(%d)\n", bnum);
+  }
+  return claimed;
+}
+
+// Give back reserved blocks, skipping any that were taken back already.
+void blocks_unreserve(int first, int count) {
+  for (int bnum = first; bnum < first + count; ++bnum) {
+    blocks_lock_group(bnum);
+    bitmap_put(blocks_reserved, bnum, 0);
+    blocks_unlock_group(bnum);
+  }
+}
+
 // Deallocate the block with the given index.
 void free_block(int bnum) {
+  if (batch_blocks) {
+    bitmap_put(batch_blocks, bnum, 1);
+    return;
+  }
+
   printf("+ free_block(%d)\n", bnum);
-  void *bbm = get_blocks_bitmap();
-  bitmap_put(bbm, bnum, 0);
+#ifdef NUFS_BCACHE
+  // Before the block can be allocated again and get new contents
+  bcache_drop(bnum);
+#endif
+  blocks_lock_group(bnum);
+  bitmap_put(get_blocks_bitmap(), bnum, 0);
+  blocks_unlock_group(bnum);
+}
+
+// Allocate an inode number.
+int alloc_inode_bit() {
+  void *ibm = get_inode_bitmap();
+
+  pthread_mutex_lock(&blocks_inode_lock);
+  int inum = bitmap_find_zero(ibm, 0, BLOCK_COUNT);
+  if (inum >= 0) {
+    bitmap_put(ibm, inum, 1);
+  }
+  pthread_mutex_unlock(&blocks_inode_lock);
+
+  return inum;
+}
+
+// Mark the given inode as free.
+void free_inode_bit(int inum) {
+  if (batch_inodes) {
+    bitmap_put(batch_inodes, inum, 1);
+    return;
+  }
+
+  pthread_mutex_lock(&blocks_inode_lock);
+  bitmap_put(get_inode_bitmap(), inum, 0);
+  pthread_mutex_unlock(&blocks_inode_lock);
+}
+
+// Start a batch of frees.
+void blocks_batch_begin() {
+  assert(batch_blocks == 0);
+  batch_blocks = calloc(BLOCK_BITMAP_SIZE, 1);
+  batch_inodes = calloc(BLOCK_BITMAP_SIZE, 1);
+}
+
+// End a batch of frees, clearing everything it freed at once.
+void blocks_batch_end() {
+  uint8_t *bbm = get_blocks_bitmap();
+
+#ifdef NUFS_BCACHE
+  for (int bnum = 0; bnum < BLOCK_COUNT; ++bnum) {
+    if (bitmap_get(batch_blocks, bnum)) {
+      bcache_drop(bnum);
+    }
+  }
+#endif
+  for (int start = 0; start < BLOCK_COUNT; start += BLOCKS_GROUP_SIZE) {
+    blocks_lock_group(start);
+    bitmap_clear_mask(bbm + start / 8, batch_blocks + start / 8,
+                      BLOCKS_GROUP_SIZE);
+    blocks_unlock_group(start);
+  }
+  pthread_mutex_lock(&blocks_inode_lock);
+  bitmap_clear_mask(get_inode_bitmap(), batch_inodes, BLOCK_COUNT);
+  pthread_mutex_unlock(&blocks_inode_lock);
+  printf("+ blocks_batch_end()\n");
+
+  free(batch_blocks);
+  free(batch_inodes);
+  batch_blocks = 0;
+  batch_inodes = 0;
 }
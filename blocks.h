@@ -5,11 +5,17 @@
  * A block-based abstraction over a disk image file.
  *
  * The disk image is mmapped, so block data is accessed using pointers.
+ * Built with -DNUFS_BCACHE, it is read with pread/pwrite through a block
+ * cache instead (see bcache.h); blocks got as pointers then stay in memory
+ * until freed, so file data should go through blocks_read and blocks_write.
  */
 #ifndef BLOCKS_H
 #define BLOCKS_H
 
 #include <stdio.h>
+#include <sys/types.h>
+
+#include "bcache.h"
 
 extern const int BLOCK_COUNT; // we split the "disk" into blocks (default = 256)
 extern const int BLOCK_SIZE;  // default = 4K
@@ -17,6 +23,11 @@ extern const int NUFS_SIZE;   // default = 1MB
 
 extern const int BLOCK_BITMAP_SIZE; // default = 256 / 8 = 32
 
+// Blocks per allocation group. Each group has its own lock over its part of
+// the block bitmap, so allocations in different groups do not wait for each
+// other. A multiple of 8, so that no bitmap byte is shared by two groups.
+#define BLOCKS_GROUP_SIZE 64
+
 /** 
  * Compute the number of blocks needed to store the given number of bytes.
  *
@@ -40,6 +51,7 @@ void blocks_free();
 
 /**
  * Get the block with the given index, returning a pointer to its start.
+ * The pointer stays valid until blocks_put_held.
  *
  * @param bnum Block number (index).
  *
@@ -47,6 +59,96 @@ void blocks_free();
  */
 void *blocks_get_block(int bnum);
 
+/**
+ * Put back the blocks this thread got with blocks_get_block since it last
+ * did, after which their pointers may no longer be used. Only the block
+ * cache build keeps track; there the blocks stay pinned until then.
+ *
+ * @param dirty Nonzero if any of them may have been written to.
+ */
+void blocks_put_held(int dirty);
+
+/**
+ * Copy bytes out of the disk image.
+ *
+ * @param pos Byte offset in the image.
+ * @param buf Where to copy to.
+ * @param size Number of bytes to copy.
+ */
+void blocks_read(off_t pos, void *buf, size_t size);
+
+/**
+ * Copy bytes into the disk image.
+ *
+ * @param pos Byte offset in the image.
+ * @param buf Where to copy from.
+ * @param size Number of bytes to copy.
+ */
+void blocks_write(off_t pos, const void *buf, size_t size);
+
+/**
+ * Zero bytes of the disk image.
+ *
+ * @param pos Byte offset in the image.
+ * @param size Number of bytes to zero.
+ */
+void blocks_zero(off_t pos, size_t size);
+
+/**
+ * Write everything changed in memory back to the image file.
+ */
+void blocks_sync();
+
+/**
+ * Write everything changed back and wait until the image file is on disk.
+ *
+ * @param datasync Nonzero if only the data has to be, as for fdatasync.
+ * @return 0 on success, or a negative errno.
+ */
+int blocks_fsync(int datasync);
+
+/**
+ * Bring part of the image file up to date before it is read or written
+ * through the file descriptor.
+ *
+ * @param pos Byte offset in the image.
+ * @param size Number of bytes.
+ */
+void blocks_sync_range(off_t pos, size_t size);
+
+/**
+ * Forget in-memory copies of part of the image after it was written through
+ * the file descriptor.
+ *
+ * @param pos Byte offset in the image.
+ * @param size Number of bytes.
+ */
+void blocks_invalidate_range(off_t pos, size_t size);
+
+/**
+ * Get the hit and miss counters of the block cache.
+ *
+ * @param stats Filled in with the counters.
+ * @return 0 on success, -ENOTTY when built without the block cache.
+ */
+int blocks_cache_stats(bcache_stats_t *stats);
+
+/**
+ * Get the file descriptor of the disk image. Block n starts at byte
+ * n * BLOCK_SIZE of the file, which holds the same pages as the mapping.
+ *
+ * @return The descriptor of the open disk image.
+ */
+int blocks_get_fd();
+
+/**
+ * Start reading part of the disk image into memory, without waiting for it.
+ *
+ * @param pos Byte offset in the image of the first byte wanted.
+ * @param size Number of bytes wanted.
+ */
+void blocks_prefetch(off_t pos, size_t size);
+
 /**
  * Return a pointer to the beginning of the block bitmap.
  *
@@ -64,12 +166,43 @@ void *get_inode_bitmap();
 /**
  * Allocate a new block and return its number.
  *
- * Grabs the first unused block and marks it as allocated.
+ * Grabs the first unused block and marks it as allocated, locking one
+ * allocation group at a time.
  *
  * @return The index of the newly allocated block.
  */
 int alloc_block();
 
+/**
+ * Reserve free blocks for a file that is expected to grow into them.
+ *
+ * Reserved blocks stay free, but alloc_block only hands them out once no
+ * other block is free; blocks_claim allocates them for the reserving file.
+ * Fewer blocks are reserved than asked for as free space runs low.
+ *
+ * @param after Reserve the blocks right after this one if they are free.
+ * @param count The number of blocks wanted.
+ * @param first Set to the first reserved block.
+ * @return The number of blocks in a row reserved from first on, maybe 0.
+ */
+int blocks_reserve(int after, int count, int *first);
+
+/**
+ * Allocate a block reserved with blocks_reserve.
+ *
+ * @param bnum The block number.
+ * @return 1 if the block was allocated, 0 if it was no longer reserved.
+ */
+int blocks_claim(int bnum);
+
+/**
+ * Give back blocks reserved with blocks_reserve and not claimed.
+ *
+ * @param first The first block number.
+ * @param count The number of blocks.
+ */
+void blocks_unreserve(int first, int count);
+
 /**
  * Deallocate the block with the given number.
  *
@@ -77,4 +210,32 @@ int alloc_block();
  */
 void free_block(int bnum);
 
+/**
+ * Allocate an inode number in the inode bitmap.
+ *
+ * @return The first free inode number, or -1 if there is none.
+ */
+int alloc_inode_bit();
+
+/**
+ * Mark the inode with the given number as free in the inode bitmap.
+ *
+ * @param inum The inode number to deallocate.
+ */
+void free_inode_bit(int inum);
+
+/**
+ * Start a batch of frees.
+ *
+ * Until blocks_batch_end, free_block and free_inode_bit only note the
+ * freed numbers; nothing they free can be allocated again meanwhile.
+ * Batches are per thread.
+ */
+void blocks_batch_begin();
+
+/**
+ * End a batch of frees, clearing all the noted bitmap bits at once.
+ */
+void blocks_batch_end();
+
 #endif
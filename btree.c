@@ -0,0 +1,432 @@
+#include "blocks.h"
+#include "inode.h"
+#include "directory.h"
+#include "btree.h"
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+
+/**
+ * Gets the given node of an ordered directory.
+ *
+ * @param di Pointer to the inode of the directory.
+ * @param index Index of the node (the block index within the directory).
+ * @return Pointer to the node.
+ */
+static void *btree_node(inode_t *di, int index) {
+    return blocks_get_block(inode_get_bnum(di, index * BLOCK_SIZE));
+}
+
+/**
+ * Compares two entry names.
+ */
+static int btree_cmp(const char *a, const char *b) {
+    return strncmp(a, b, DIR_NAME_LENGTH);
+}
+
+/**
+ * Finds the child of an inner node that covers the given name.
+ *
+ * @param node The inner node.
+ * @param name The name to look for.
+ * @return The child position, i.e. the number of keys <= name.
+ */
+static int btree_child_pos(btree_inner_t *node, const char *name) {
+    int lo = 0;
+    int hi = node->hdr.count;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (btree_cmp(node->keys[mid], name) <= 0) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+/**
+ * Finds the first entry of a leaf at or after the given name.
+ *
+ * @param leaf The leaf.
+ * @param name The name to look for.
+ * @param inclusive Whether an entry equal to name counts.
+ * @return The position of the first entry >= name (or > name).
+ */
+static int btree_leaf_pos(btree_leaf_t *leaf, const char *name, int inclusive) {
+    int lo = 0;
+    int hi = leaf->hdr.count;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        int cmp = btree_cmp(leaf->entries[mid].name, name);
+        if (cmp < 0 || (cmp == 0 && !inclusive)) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+/**
+ * Checks whether a node has no room for another entry or key.
+ */
+static int btree_full(btree_header_t *node) {
+    return node->count == (node->leaf ? BTREE_LEAF_ENTRIES : BTREE_INNER_KEYS);
+}
+
+/**
+ * Takes a node off the free list, or grows the directory by one block.
+ *
+ * @param di Pointer to the inode of the directory.
+ * @return The index of the new node, or -1 if the disk is full.
+ */
+static int btree_alloc_node(inode_t *di) {
+    btree_header_t *root = btree_node(di, 0);
+
+    // Reuse a node that dropped out of the tree
+    if (root->free) {
+        int index = root->free;
+        root->free = ((btree_header_t *) btree_node(di, index))->next;
+        return index;
+    }
+
+    int index = di->size / BLOCK_SIZE;
+    if (grow_inode(di, di->size + BLOCK_SIZE) < 0) {
+        return -1;
+    }
+
+    return index;
+}
+
+/**
+ * Puts a node that is no longer in the tree on the free list.
+ *
+ * @param di Pointer to the inode of the directory.
+ * @param index Index of the node.
+ */
+static void btree_free_node(inode_t *di, int index) {
+    btree_header_t *root = btree_node(di, 0);
+    btree_header_t *node = btree_node(di, index);
+
+    node->next = root->free;
+    root->free = index;
+}
+
+/**
+ * Splits the full child at the given position of an inner node in two.
+ *
+ * The upper half moves to a new node, which is linked into the parent
+ * right after the old one. The parent must have room for one more key.
+ *
+ * @param di Pointer to the inode of the directory.
+ * @param parent_index Index of the inner node.
+ * @param pos Position of the child to split.
+ * @return 0 on success, or -ENOSPC if the disk is full.
+ */
+static int btree_split(inode_t *di, int parent_index, int pos) {
+    int right_index = btree_alloc_node(di);
+    if (right_index < 0) {
+        return -ENOSPC;
+    }
+
+    btree_inner_t *parent = btree_node(di, parent_index);
+    btree_header_t *left = btree_node(di, parent->children[pos]);
+    btree_header_t *right = btree_node(di, right_index);
+    char separator[DIR_NAME_LENGTH];
+
+    if (left->leaf) {
+        // Leaves keep the lower half; the first name moving right separates them
+        btree_leaf_t *l = (btree_leaf_t *) left;
+        btree_leaf_t *r = (btree_leaf_t *) right;
+        int keep = BTREE_LEAF_ENTRIES / 2;
+
+        r->hdr.leaf = 1;
+        r->hdr.count = l->hdr.count - keep;
+        memcpy(r->entries, l->entries + keep, r->hdr.count * sizeof(dirent_t));
+        l->hdr.count = keep;
+        memcpy(separator, r->entries[0].name, DIR_NAME_LENGTH);
+    }
+    else {
+        // Inner nodes hand their middle key up to the parent
+        btree_inner_t *l = (btree_inner_t *) left;
+        btree_inner_t *r = (btree_inner_t *) right;
+        int keep = BTREE_INNER_KEYS / 2;
+
+        r->hdr.leaf = 0;
+        r->hdr.count = l->hdr.count - keep - 1;
+        memcpy(r->keys, l->keys[keep + 1], r->hdr.count * DIR_NAME_LENGTH);
+        memcpy(r->children, l->children + keep + 1, (r->hdr.count + 1) * sizeof(int));
+        memcpy(separator, l->keys[keep], DIR_NAME_LENGTH);
+        l->hdr.count = keep;
+    }
+    right->next = 0;
+    right->free = 0;
+
+    // Make room in the parent for the separator and the new child
+    memmove(parent->keys[pos + 1], parent->keys[pos],
+            (parent->hdr.count - pos) * DIR_NAME_LENGTH);
+    memmove(parent->children + pos + 2, parent->children + pos + 1,
+            (parent->hdr.count - pos) * sizeof(int));
+    memcpy(parent->keys[pos], separator, DIR_NAME_LENGTH);
+    parent->children[pos + 1] = right_index;
+    parent->hdr.count++;
+
+    return 0;
+}
+
+/**
+ * Adds a level on top of a full root.
+ *
+ * The root has to stay at block 0, so its contents move to a new node that
+ * becomes the only child of the root, and that child is then split.
+ *
+ * @param di Pointer to the inode of the directory.
+ * @return 0 on success, or -ENOSPC if the disk is full.
+ */
+static int btree_grow_root(inode_t *di) {
+    int index = btree_alloc_node(di);
+    if (index < 0) {
+        return -ENOSPC;
+    }
+
+    btree_inner_t *root = btree_node(di, 0);
+    btree_header_t *child = btree_node(di, index);
+
+    memcpy(child, root, BLOCK_SIZE);
+    child->free = 0;
+
+    root->hdr.leaf = 0;
+    root->hdr.count = 0;
+    root->children[0] = index;
+
+    return btree_split(di, 0, 0);
+}
+
+/**
+ * Looks up a name in an ordered directory.
+ *
+ * @param di Pointer to the inode of the directory.
+ * @param name The name of the entry to look for.
+ * @return Pointer to the entry, or NULL if not found.
+ */
+dirent_t *btree_find(inode_t *di, const char *name) {
+
+    // An ordered directory without blocks is empty
+    if (di->size == 0) {
+        return NULL;
+    }
+
+    // Walk down to the leaf covering the name
+    btree_header_t *node = btree_node(di, 0);
+    while (!node->leaf) {
+        btree_inner_t *inner = (btree_inner_t *) node;
+        node = btree_node(di, inner->children[btree_child_pos(inner, name)]);
+    }
+
+    btree_leaf_t *leaf = (btree_leaf_t *) node;
+    int pos = btree_leaf_pos(leaf, name, 1);
+    if (pos == leaf->hdr.count || btree_cmp(leaf->entries[pos].name, name) != 0) {
+        return NULL;
+    }
+
+    return &leaf->entries[pos];
+}
+
+/**
+ * Adds an entry to an ordered directory.
+ *
+ * Full nodes are split on the way down, so the leaf that receives the entry
+ * always has room for it.
+ *
+ * @param di Pointer to the inode of the directory.
+ * @param entry The entry to add.
+ * @return 0 on success, -EEXIST if the name is taken, or -ENOSPC.
+ */
+int btree_insert(inode_t *di, const dirent_t *entry) {
+
+    // The first entry creates the root leaf
+    if (di->size == 0) {
+        if (grow_inode(di, BLOCK_SIZE) < 0) {
+            return -ENOSPC;
+        }
+        btree_header_t *root = btree_node(di, 0);
+        memset(root, 0, sizeof(btree_header_t));
+        root->leaf = 1;
+    }
+
+    if (btree_find(di, entry->name) != NULL) {
+        return -EEXIST;
+    }
+
+    if (btree_full(btree_node(di, 0)) && btree_grow_root(di) < 0) {
+        return -ENOSPC;
+    }
+
+    // Walk down, splitting any full child before entering it
+    int index = 0;
+    btree_header_t *node = btree_node(di, index);
+    while (!node->leaf) {
+        btree_inner_t *inner = (btree_inner_t *) node;
+        int pos = btree_child_pos(inner, entry->name);
+
+        if (btree_full(btree_node(di, inner->children[pos]))) {
+            if (btree_split(di, index, pos) < 0) {
+                return -ENOSPC;
+            }
+            if (btree_cmp(entry->name, inner->keys[pos]) >= 0) {
+                pos++;
+            }
+        }
+
+        index = inner->children[pos];
+        node = btree_node(di, index);
+    }
+
+    // Insert the entry in name order
+    btree_leaf_t *leaf = (btree_leaf_t *) node;
+    int pos = btree_leaf_pos(leaf, entry->name, 1);
+    memmove(&leaf->entries[pos + 1], &leaf->entries[pos],
+            (leaf->hdr.count - pos) * sizeof(dirent_t));
+    leaf->entries[pos] = *entry;
+    leaf->hdr.count++;
+
+    return 0;
+}
+
+/**
+ * Removes an entry from an ordered directory.
+ *
+ * Nodes are not rebalanced. A node that becomes empty is unlinked from its
+ * parent and put on the free list.
+ *
+ * @param di Pointer to the inode of the directory.
+ * @param name The name of the entry to remove.
+ * @param removed If not NULL, receives a copy of the removed entry.
+ * @return 0 on success, or -ENOENT if the name is not there.
+ */
+int btree_remove(inode_t *di, const char *name, dirent_t *removed) {
+
+    if (di->size == 0) {
+        return -ENOENT;
+    }
+
+    // Walk down to the leaf, remembering the way back up
+    int path[BTREE_MAX_DEPTH];
+    int path_pos[BTREE_MAX_DEPTH];
+    int depth = 0;
+    int index = 0;
+    btree_header_t *node = btree_node(di, index);
+    while (!node->leaf) {
+        btree_inner_t *inner = (btree_inner_t *) node;
+        assert(depth < BTREE_MAX_DEPTH);
+
+        path[depth] = index;
+        path_pos[depth] = btree_child_pos(inner, name);
+        index = inner->children[path_pos[depth]];
+        node = btree_node(di, index);
+        depth++;
+    }
+
+    btree_leaf_t *leaf = (btree_leaf_t *) node;
+    int pos = btree_leaf_pos(leaf, name, 1);
+    if (pos == leaf->hdr.count || btree_cmp(leaf->entries[pos].name, name) != 0) {
+        return -ENOENT;
+    }
+
+    if (removed) {
+        *removed = leaf->entries[pos];
+    }
+
+    memmove(&leaf->entries[pos], &leaf->entries[pos + 1],
+            (leaf->hdr.count - pos - 1) * sizeof(dirent_t));
+    leaf->hdr.count--;
+
+    // Unlink nodes that became empty, as far up as needed
+    int empty = leaf->hdr.count == 0;
+    while (empty && depth > 0) {
+        btree_free_node(di, index);
+
+        depth--;
+        index = path[depth];
+        btree_inner_t *parent = btree_node(di, index);
+        int child = path_pos[depth];
+
+        // The parent loses its only child
+        if (parent->hdr.count == 0) {
+            continue;
+        }
+
+        // Drop the child along with the key on one side of it
+        int key = child > 0 ? child - 1 : 0;
+        memmove(parent->keys[key], parent->keys[key + 1],
+                (parent->hdr.count - key - 1) * DIR_NAME_LENGTH);
+        memmove(parent->children + child, parent->children + child + 1,
+                (parent->hdr.count - child) * sizeof(int));
+        parent->hdr.count--;
+        empty = 0;
+    }
+
+    // Everything is gone, the root starts over as an empty leaf
+    if (empty) {
+        btree_header_t *root = btree_node(di, 0);
+        root->leaf = 1;
+        root->count = 0;
+    }
+
+    return 0;
+}
+
+/**
+ * Finds the first entry of an ordered directory at or after a given name.
+ *
+ * @param di Pointer to the inode of the directory.
+ * @param key The name to start from ("" for the first entry).
+ * @param inclusive Whether an entry named key itself counts.
+ * @return Pointer to the entry, or NULL if there is none.
+ */
+dirent_t *btree_next(inode_t *di, const char *key, int inclusive) {
+    char target[DIR_NAME_LENGTH];
+    char bound[DIR_NAME_LENGTH];
+
+    if (di->size == 0) {
+        return NULL;
+    }
+
+    strncpy(target, key, DIR_NAME_LENGTH);
+
+    for (;;) {
+        // Walk down, remembering the smallest separator above the target
+        int has_bound = 0;
+        btree_header_t *node = btree_node(di, 0);
+        while (!node->leaf) {
+            btree_inner_t *inner = (btree_inner_t *) node;
+            int pos = btree_child_pos(inner, target);
+
+            if (pos < inner->hdr.count) {
+                memcpy(bound, inner->keys[pos], DIR_NAME_LENGTH);
+                has_bound = 1;
+            }
+            node = btree_node(di, inner->children[pos]);
+        }
+
+        btree_leaf_t *leaf = (btree_leaf_t *) node;
+        int pos = btree_leaf_pos(leaf, target, inclusive);
+        if (pos < leaf->hdr.count) {
+            return &leaf->entries[pos];
+        }
+
+        // This leaf is done, continue in the subtree after the separator
+        if (!has_bound) {
+            return NULL;
+        }
+        memcpy(target, bound, DIR_NAME_LENGTH);
+        inclusive = 1;
+    }
+}
@@ -0,0 +1,44 @@
+// Ordered directories kept as a B+tree of entries keyed by name.
+//
+// The nodes are the blocks of the directory inode. Block 0 is always the
+// root; nodes that drop out of the tree go on a free list kept in the root
+// and are reused before the directory grows.
+
+#ifndef BTREE_H
+#define BTREE_H
+
+#include "directory.h"
+#include "inode.h"
+
+// Entries per leaf and keys per inner node, so that a node fills one block
+#define BTREE_LEAF_ENTRIES 60
+#define BTREE_INNER_KEYS 78
+
+// Deepest tree supported (inner nodes are at least half full after a split)
+#define BTREE_MAX_DEPTH 8
+
+typedef struct btree_header {
+  int leaf;  // 1 for a leaf, 0 for an inner node
+  int count; // entries in a leaf, keys in an inner node
+  int next;  // next node on the free list, 0 at the end
+  int free;  // first node on the free list (kept in the root)
+} btree_header_t;
+
+typedef struct btree_leaf {
+  btree_header_t hdr;
+  dirent_t entries[BTREE_LEAF_ENTRIES]; // sorted by name
+} btree_leaf_t;
+
+// Child i holds the names in [keys[i-1], keys[i])
+typedef struct btree_inner {
+  btree_header_t hdr;
+  int children[BTREE_INNER_KEYS + 1]; // node (block) indices
+  char keys[BTREE_INNER_KEYS][DIR_NAME_LENGTH];
+} btree_inner_t;
+
+dirent_t *btree_find(inode_t *di, const char *name);
+int btree_insert(inode_t *di, const dirent_t *entry);
+int btree_remove(inode_t *di, const char *name, dirent_t *removed);
+dirent_t *btree_next(inode_t *di, const char *key, int inclusive);
+
+#endif
@@ -0,0 +1,113 @@
+// Cache-bypassing copies for large file data, see copy.h.
+
+#include <stdint.h>
+#include <string.h>
+
+#include "copy.h"
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+
+// Copy the head with memcpy until dst is aligned for the streaming stores,
+// and leave what does not fill a whole store for the caller's tail copy.
+static size_t copy_head(uint8_t **dst, const uint8_t **src, size_t size,
+                        size_t align) {
+  size_t head = -(uintptr_t) *dst & (align - 1);
+
+  if (head > size) {
+    head = size;
+  }
+
+  memcpy(*dst, *src, head);
+  *dst += head;
+  *src += head;
+  return size - head;
+}
+
+__attribute__((target("avx512f"))) static void
+copy_avx512(void *dst, const void *src, size_t size) {
+  uint8_t *d = dst;
+  const uint8_t *s = src;
+
+  size = copy_head(&d, &s, size, 64);
+  for (; size >= 64; size -= 64, d += 64, s += 64) {
+    _mm512_stream_si512((void *) d, _mm512_loadu_si512((const void *) s));
+  }
+  // The streaming stores are weakly ordered; finish them before returning
+  _mm_sfence();
+  memcpy(d, s, size);
+}
+
+__attribute__((target("avx2"))) static void
+copy_avx2(void *dst, const void *src, size_t size) {
+  uint8_t *d = dst;
+  const uint8_t *s = src;
+
+  size = copy_head(&d, &s, size, 32);
+  for (; size >= 64; size -= 64, d += 64, s += 64) {
+    __m256i a = _mm256_loadu_si256((const __m256i *) s);
+    __m256i b = _mm256_loadu_si256((const __m256i *) (s + 32));
+    _mm256_stream_si256((__m256i *) d, a);
+    _mm256_stream_si256((__m256i *) (d + 32), b);
+  }
+  _mm_sfence();
+  memcpy(d, s, size);
+}
+
+static void copy_movsb(void *dst, const void *src, size_t size) {
+  __asm__ volatile("rep movsb"
+                   : "+D"(dst), "+S"(src), "+c"(size)
+                   :
+                   : "memory");
+}
+
+// Whether the CPU has enhanced rep movsb/stosb (CPUID.7.0:EBX bit 9).
+static int copy_has_erms() {
+  unsigned int eax, ebx, ecx, edx;
+
+  if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+    return 0;
+  }
+  return (ebx >> 9) & 1;
+}
+#endif
+
+typedef void (*copy_fn)(void *dst, const void *src, size_t size);
+
+static void copy_memcpy(void *dst, const void *src, size_t size) {
+  memcpy(dst, src, size);
+}
+
+static void copy_resolve(void *dst, const void *src, size_t size);
+
+// The copy used above the threshold, settled by the first call. Requests
+// are served from several threads, so it is loaded and stored atomically.
+static copy_fn copy_large = copy_resolve;
+
+static void copy_resolve(void *dst, const void *src, size_t size) {
+  copy_fn fn = copy_memcpy;
+
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    fn = copy_avx512;
+  } else if (__builtin_cpu_supports("avx2")) {
+    fn = copy_avx2;
+  } else if (copy_has_erms()) {
+    fn = copy_movsb;
+  }
+#endif
+
+  __atomic_store_n(&copy_large, fn, __ATOMIC_RELAXED);
+  fn(dst, src, size);
+}
+
+// Copy file data, bypassing the caches if there is a lot of it.
+void copy_data(void *dst, const void *src, size_t size) {
+  if (size < COPY_NT_THRESHOLD) {
+    memcpy(dst, src, size);
+  } else {
+    __atomic_load_n(&copy_large, __ATOMIC_RELAXED)(dst, src, size);
+  }
+}
@@ -0,0 +1,26 @@
+// Copying file data between FUSE buffers and the image.
+//
+// Large copies bypass the CPU caches, so streaming a big file does not push
+// out the inodes, bitmaps and directory blocks every request needs. The
+// way to do that is picked at the first call from what the CPU supports:
+// non-temporal AVX-512 or AVX2 stores, else rep movsb on CPUs with fast
+// string moves (ERMS), else plain memcpy. Small copies always use memcpy.
+
+#ifndef COPY_H
+#define COPY_H
+
+#include <stddef.h>
+
+// Copies at least this long bypass the caches
+#define COPY_NT_THRESHOLD (256 * 1024)
+
+/**
+ * Copy file data, like memcpy.
+ *
+ * @param dst Where to copy to.
+ * @param src Where to copy from; must not overlap dst.
+ * @param size Number of bytes.
+ */
+void copy_data(void *dst, const void *src, size_t size);
+
+#endif
@@ -2,12 +2,19 @@
 #include "inode.h"
 #include "slist.h"
 #include "directory.h"
+#include "btree.h"
 #include "bitmap.h"
 #include <assert.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <errno.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 /**
  * Initializes the root directory in the filesystem
@@ -40,6 +47,186 @@ void directory_init() {
 
 }
 
+/**
+ * Hashes an entry name (FNV-1a over at most DIR_NAME_LENGTH characters).
+ *
+ * @param name The entry name.
+ * @return The hash, never 0 since 0 marks a free slot.
+ */
+static uint32_t directory_hash(const char *name) {
+    uint32_t hash = 2166136261u;
+
+    for (int i = 0; i < DIR_NAME_LENGTH && name[i] != 0; ++i) {
+        hash ^= (uint8_t) name[i];
+        hash *= 16777619u;
+    }
+
+    return hash ? hash : 1;
+}
+
+/**
+ * Gets the given block of a directory.
+ *
+ * @param di Pointer to the inode of the directory.
+ * @param index Index of the block within the directory.
+ * @return Pointer to the directory block.
+ */
+static dirblock_t *directory_block(inode_t *di, int index) {
+    return blocks_get_block(inode_get_bnum(di, index * BLOCK_SIZE));
+}
+
+typedef uint64_t (*directory_compare_fn)(const uint32_t *hashes, int count, uint32_t hash);
+
+/**
+ * Compares a hash against slot hashes one slot at a time.
+ *
+ * @param hashes The slot hashes of the block.
+ * @param count Number of slots to compare.
+ * @param hash The hash to look for.
+ * @return A bit mask with bit i set if slot i has the given hash.
+ */
+static uint64_t directory_compare_slots(const uint32_t *hashes, int count, uint32_t hash) {
+    uint64_t mask = 0;
+
+    for (int i = 0; i < count; ++i) {
+        if (hashes[i] == hash) {
+            mask |= (uint64_t) 1 << i;
+        }
+    }
+
+    return mask;
+}
+
+#if defined(__x86_64__)
+/**
+ * Compares a hash against slot hashes 8 at a time with AVX2. May look at
+ * a few slots past count.
+ */
+__attribute__((target("avx2")))
+static uint64_t directory_compare_avx2(const uint32_t *hashes, int count, uint32_t hash) {
+    uint64_t mask = 0;
+
+    __m256i key = _mm256_set1_epi32(hash);
+    for (int i = 0; i < count; i += 8) {
+        __m256i slots = _mm256_loadu_si256((const __m256i *) (hashes + i));
+        __m256i eq = _mm256_cmpeq_epi32(slots, key);
+        mask |= (uint64_t) _mm256_movemask_ps(_mm256_castsi256_ps(eq)) << i;
+    }
+
+    return mask;
+}
+
+/**
+ * Compares a hash against slot hashes 4 at a time with SSE2, which every
+ * x86-64 CPU has. May look at a few slots past count.
+ */
+static uint64_t directory_compare_sse2(const uint32_t *hashes, int count, uint32_t hash) {
+    uint64_t mask = 0;
+
+    __m128i key = _mm_set1_epi32(hash);
+    for (int i = 0; i < count; i += 4) {
+        __m128i slots = _mm_loadu_si128((const __m128i *) (hashes + i));
+        __m128i eq = _mm_cmpeq_epi32(slots, key);
+        mask |= (uint64_t) _mm_movemask_ps(_mm_castsi128_ps(eq)) << i;
+    }
+
+    return mask;
+}
+#endif
+
+static uint64_t directory_compare_resolve(const uint32_t *hashes, int count, uint32_t hash);
+
+// The compare used by directory_match, settled by the first call; atomic
+// since lookups in different directories may run at the same time
+static directory_compare_fn directory_compare = directory_compare_resolve;
+
+/**
+ * Picks the widest compare the CPU supports, then does the first compare.
+ */
+static uint64_t directory_compare_resolve(const uint32_t *hashes, int count, uint32_t hash) {
+    directory_compare_fn fn = directory_compare_slots;
+
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    fn = __builtin_cpu_supports("avx2") ? directory_compare_avx2 : directory_compare_sse2;
+#endif
+
+    __atomic_store_n(&directory_compare, fn, __ATOMIC_RELAXED);
+    return fn(hashes, count, hash);
+}
+
+/**
+ * Compares a hash against the first count slot hashes of a directory block.
+ *
+ * Uses AVX2 (8 slots per compare) when the CPU has it, SSE2 (4 slots per
+ * compare) on other x86-64 CPUs, and a plain loop elsewhere.
+ *
+ * @param hashes The slot hashes of the block.
+ * @param count Number of slots in use in the block.
+ * @param hash The hash to look for.
+ * @return A bit mask with bit i set if slot i has the given hash.
+ */
+static uint64_t directory_match(const uint32_t *hashes, int count, uint32_t hash) {
+    directory_compare_fn compare = __atomic_load_n(&directory_compare, __ATOMIC_RELAXED);
+    uint64_t mask = compare(hashes, count, hash);
+
+    // The vector loops may look at a few slots past the ones in use
+    return mask & (((uint64_t) 1 << count) - 1);
+}
+
+/**
+ * Finds the slot holding the given name in a directory.
+ *
+ * Only slots whose stored hash matches get their name compared.
+ *
+ * @param di Pointer to the inode of the directory to search.
+ * @param name The name of the entry to look for.
+ * @return The slot of the entry in the directory, or -1 if the name is not there.
+ */
+static int directory_find(inode_t *di, const char *name) {
+    uint32_t hash = directory_hash(name);
+
+    for (int b = 0; b < di->size / BLOCK_SIZE; ++b) {
+        dirblock_t *db = directory_block(di, b);
+        uint64_t candidates =
+            directory_match(db->hashes, DIRENTS_PER_BLOCK, hash) & db->used;
+
+        while (candidates) {
+            int i = __builtin_ctzll(candidates);
+            candidates &= candidates - 1;
+
+            if (strncmp(db->entries[i].name, name, DIR_NAME_LENGTH) == 0) {
+                return b * DIRENTS_PER_BLOCK + i;
+            }
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Finds the entry with the given name in a directory.
+ *
+ * @param di Pointer to the inode of the directory to search.
+ * @param name The name of the entry to look for.
+ * @return Pointer to the entry, or NULL if the name is not there.
+ */
+static dirent_t *directory_entry(inode_t *di, const char *name) {
+
+    // Ordered directories keep their own index
+    if (di->flags & INODE_ORDERED) {
+        return btree_find(di, name);
+    }
+
+    int slot = directory_find(di, name);
+    if (slot < 0) {
+        return NULL;
+    }
+
+    dirblock_t *db = directory_block(di, slot / DIRENTS_PER_BLOCK);
+    return &db->entries[slot % DIRENTS_PER_BLOCK];
+}
+
 /**
  * Looks up a directory entry by name within a given directory.
  * 
@@ -49,29 +236,30 @@ void directory_init() {
 */
 int directory_lookup(inode_t *di, const char *name) {
 
-    // Max number of entries
-    int num_entries = 64;
-
     // Checking if the given directory is the root directory, if so then return 0
     if (strcmp("",  name) == 0) {
         return 0; // Root directory
     }
 
-    // Gets the array of the directory entries
-    dirent_t *dir_entries = blocks_get_block(di->pointers[0]);
+    // '..' is not stored as an entry, the directory knows its parent
+    if (strcmp("..", name) == 0) {
+        return di->parent;
+    }
 
     // Getting the inum for the current directory name
-    for (int i = 0; i < num_entries; ++i) {
-        if (strcmp(dir_entries[i].name, name) == 0 && dir_entries[i].input_allocation == 1) {
-            return dir_entries[i].inum;
-        }
+    dirent_t *entry = directory_entry(di, name);
+    if (entry == NULL) {
+        return -1;
     }
-    return -1;
+
+    return entry->inum;
 
 }
 
 /**
  * Looks up the inode number for a given path in the filesystem.
+ *
+ * Each directory on the way is locked while it is searched, and only then.
  * 
  * @param path The file path for which to find the inode number.
  * @return The inode number of the directory or file at the given path.
@@ -86,10 +274,18 @@ int path_lookup(const char *path) {
 
     for (slist_t *curr_dir=all_directories; curr_dir != NULL; curr_dir = curr_dir->next) {
 
+        // '.' stays in the current directory
+        if (strcmp(curr_dir->data, ".") == 0) {
+            continue;
+        }
+
         // Current directory node
         inode_t *dir_node = get_inode(inum);
 
-        inum = directory_lookup(dir_node, curr_dir->data);
+        int dir_inum = inum;
+        inode_rdlock(dir_inum);
+        inum = S_ISDIR(dir_node->mode) ? directory_lookup(dir_node, curr_dir->data) : -1;
+        inode_unlock(dir_inum);
 
         // Freeing the list if the lookup is not found
         if (inum == -1) {
@@ -105,46 +301,184 @@ int path_lookup(const char *path) {
 
 }
 
+/**
+ * Adds several entries to a directory in one pass.
+ *
+ * The first block's free_hint points at the first block that may have room,
+ * and the block's used mask gives the free slots directly, so the entries go
+ * into the free slots of each block in turn without scanning any entries.
+ * New blocks are added when every block is full, and the hint is updated
+ * once at the end.
+ *
+ * Ordered directories insert the entries into their B+tree instead.
+ *
+ * The names must not be in the directory already.
+ *
+ * @param di Pointer to the inode of the directory.
+ * @param entries The entries to add (name, inum and type are used).
+ * @param count The number of entries.
+ * @return The number of entries added, which is less than count only if
+ *         the directory ran out of space, or an error code if none was.
+ */
+int directory_put_batch(inode_t *di, const dirent_t *entries, int count) {
+    int done = 0;
+
+    if (di->flags & INODE_ORDERED) {
+        int rv = 0;
+
+        while (done < count && (rv = btree_insert(di, &entries[done])) == 0) {
+            ++done;
+        }
+        di->entries += done;
+        return done || count == 0 ? done : rv;
+    }
+
+    // Total number of blocks
+    int blocks = di->size / BLOCK_SIZE;
+
+    // Skip over the blocks that are known to be full
+    int b = blocks ? directory_block(di, 0)->free_hint : 0;
+
+    while (done < count) {
+        if (b == blocks) {
+            // Every block is full, add a new empty one
+            if (grow_inode(di, (blocks + 1) * BLOCK_SIZE) < 0) {
+                break;
+            }
+            memset(directory_block(di, b), 0, offsetof(dirblock_t, entries));
+            ++blocks;
+        }
+
+        dirblock_t *db = directory_block(di, b);
+
+        // Fill the free slots of the block, first one first
+        while (done < count && db->used != DIRBLOCK_FULL) {
+            int i = __builtin_ctzll(~db->used);
+
+            db->entries[i] = entries[done];
+            db->hashes[i] = directory_hash(entries[done].name);
+            db->used |= (uint64_t) 1 << i;
+            ++done;
+        }
+
+        if (db->used == DIRBLOCK_FULL) {
+            ++b;
+        }
+    }
+
+    // Remember where the next free slot may be
+    if (blocks) {
+        directory_block(di, 0)->free_hint = b;
+    }
+    di->entries += done;
+
+    return done || count == 0 ? done : -ENOSPC;
+}
+
 /**
  * This function adds a directory entry for the given name and inode number.
  *
  * @param di Pointer to the inode of the directory where the entry will be added.
  * @param name Name of the new entry to be added.
  * @param inum Inode number of the new entry.
- * @return 0 on success.
+ * @return 0 on success, or -ENOSPC if the directory cannot grow.
  *
  */
 int directory_put(inode_t *di, const char *name, int inum) {
-    
-    // Total number of entries
-    int entries = di->size / sizeof(dirent_t);
-    dirent_t *directory_entries = blocks_get_block(di->pointers[0]);
-    
-    // mock allocated check
-    int allocated_check = 0;
-
-    // new mock dirent structure with inum and allocated entry
-    dirent_t mock_dir;
-    strncpy(mock_dir.name, name, DIR_NAME_LENGTH); 
-    mock_dir.inum = inum; 
-    mock_dir.input_allocation = 1; 
-
-    // Insert the new entry into the directory
-    for (int i = 1; i < entries; i++) {
-        if (directory_entries[i].input_allocation == 0) {
-            directory_entries[i] = mock_dir;
-            allocated_check = 1;
-            return 0;
+
+    dirent_t entry;
+    memset(&entry, 0, sizeof(entry));
+    strncpy(entry.name, name, DIR_NAME_LENGTH);
+    entry.inum = inum;
+    entry.input_allocation = 1;
+    entry.type = DIRENT_TYPE(get_inode(inum)->mode);
+
+    int rv = directory_put_batch(di, &entry, 1);
+    return rv < 0 ? rv : 0;
+}
+
+/**
+ * Removes the entry with the given name from a directory.
+ *
+ * @param di Pointer to the inode of the directory.
+ * @param name The name of the entry to remove.
+ * @return The inode number the entry pointed to, or -ENOENT.
+ */
+static int directory_remove(inode_t *di, const char *name) {
+
+    if (di->flags & INODE_ORDERED) {
+        dirent_t removed;
+        int rv = btree_remove(di, name, &removed);
+        if (rv < 0) {
+            return rv;
         }
+        di->entries--;
+        return removed.inum;
     }
 
-    // If no free space is found for the mock dir add at the end
-    directory_entries[entries] = mock_dir;
+    // Find the entry with the matching name
+    int slot = directory_find(di, name);
 
-    // Update the size of the entry array
-    di->size = di->size + sizeof(dirent_t);
+    // Return an error code if the directory is not found
+    if (slot < 0) {
+        return -ENOENT;
+    }
 
-    return 0;
+    int b = slot / DIRENTS_PER_BLOCK;
+    int i = slot % DIRENTS_PER_BLOCK;
+    dirblock_t *db = directory_block(di, b);
+    int inum = db->entries[i].inum;
+
+    // Deallocate the entry from the directory
+    db->entries[i].input_allocation = 0;
+    db->hashes[i] = 0;
+    db->used &= ~((uint64_t) 1 << i);
+
+    // This block has room now
+    dirblock_t *first = directory_block(di, 0);
+    if (b < first->free_hint) {
+        first->free_hint = b;
+    }
+    di->entries--;
+
+    return inum;
+}
+
+/**
+ * Drops one reference to an inode, freeing it once nothing refers to it.
+ * A directory that is freed drops a reference to each of its entries in
+ * turn, so its whole subtree goes with it.
+ *
+ * @param inum The inode losing a reference.
+ */
+static void directory_release(int inum) {
+    inode_t *node = get_inode(inum);
+
+    // Still linked elsewhere (hard links to files)
+    if (--node->refs > 0) {
+        return;
+    }
+
+    if (S_ISDIR(node->mode)) {
+        dir_cursor_t cur = { 0 };
+        dirent_t *entry;
+
+        // Entries are read straight from the dying directory's blocks, and
+        // each is locked while it goes, as the caller locked this one
+        while ((entry = directory_next(node, &cur)) != NULL) {
+            int child = entry->inum;
+            inode_wrlock(child);
+            directory_release(child);
+            inode_unlock(child);
+        }
+
+        // Left empty, in case it is pinned and outlives this call
+        shrink_inode(node, 0);
+        node->entries = 0;
+        node->flags &= ~INODE_ORDERED;
+    }
+
+    free_inode(inum);
 }
 
 /**
@@ -157,34 +491,305 @@ int directory_put(inode_t *di, const char *name, int inum) {
  */
 int directory_delete(inode_t *di, const char *name) {
 
-    // Total number of entries
-    int entries = di->size / sizeof(dirent_t);
-    dirent_t *directory_entries = blocks_get_block(di->pointers[0]);
-
-    for (int i = 0; i < entries; i++) {
-        
-        // Check the current entry if the name matches
-        if (strcmp(directory_entries[i].name, name) == 0 && directory_entries[i].input_allocation) {
-            
-            // Delete the current entry
-            int inum = directory_entries[i].inum;
-            inode_t *curr_inode = get_inode(inum);
-            curr_inode->refs--;
-
-            // Proceed to free the inode if refs is 0 or less
-            if (curr_inode->refs <= 0) {
-                free_inode(inum);
-            }
+    // Delete the current entry
+    int inum = directory_remove(di, name);
+
+    // Return an error code if the directory is not found
+    if (inum < 0) {
+        return inum;
+    }
+
+    // Proceed to free the inode if nothing else refers to it
+    directory_release(inum);
+
+    return 0;
+}
+
+/**
+ * Deletes an entry together with everything below it. Directories are
+ * walked by inode, without resolving any paths; files that are still
+ * linked from outside the subtree are kept.
+ *
+ * @param di Pointer to the inode of the directory holding the entry.
+ * @param name The name of the entry to delete.
+ * @return 0 on success, or -ENOENT if there is no such entry.
+ */
+int directory_delete_tree(inode_t *di, const char *name) {
+
+    // Unlink the top of the subtree first, so it is gone from the namespace
+    int inum = directory_remove(di, name);
+
+    if (inum < 0) {
+        return inum;
+    }
+
+    directory_release(inum);
+
+    return 0;
+}
+
+/**
+ * Renames a directory entry in one step.
+ *
+ * Each directory involved is updated once: an existing target entry is
+ * pointed at the moved inode in place, and a rename within a plain
+ * directory only rewrites the name of the entry. The reference count of
+ * the moved inode never changes.
+ *
+ * @param from_dir Pointer to the inode of the directory holding the entry.
+ * @param from The current name of the entry.
+ * @param to_dir Pointer to the inode of the directory to move the entry to.
+ * @param to The new name of the entry.
+ * @param flags RENAME_NOREPLACE to fail if the target exists, or
+ *              RENAME_EXCHANGE to swap the two entries.
+ * @return 0 on success, or a negative error code on failure.
+ */
+int directory_rename(inode_t *from_dir, const char *from, inode_t *to_dir,
+                     const char *to, unsigned int flags) {
 
-            // Deallocate the entry from the directory
-            directory_entries[i].input_allocation = 0;
+    // Unknown flags, or both at once
+    if ((flags & ~(RENAME_NOREPLACE | RENAME_EXCHANGE)) ||
+        flags == (RENAME_NOREPLACE | RENAME_EXCHANGE)) {
+        return -EINVAL;
+    }
+
+    dirent_t *src = directory_entry(from_dir, from);
+    if (src == NULL) {
+        return -ENOENT;
+    }
+    int inum = src->inum;
 
+    dirent_t *dst = directory_entry(to_dir, to);
+
+    // Swap the inodes the two entries point to
+    if (flags & RENAME_EXCHANGE) {
+        if (dst == NULL) {
+            return -ENOENT;
+        }
+
+        dirent_t tmp = *src;
+        src->inum = dst->inum;
+        src->type = dst->type;
+        dst->inum = tmp.inum;
+        dst->type = tmp.type;
+        return 0;
+    }
+
+    if (dst != NULL) {
+        if (flags & RENAME_NOREPLACE) {
+            return -EEXIST;
+        }
+
+        // Both names already refer to the same file
+        if (dst->inum == inum) {
             return 0;
         }
+
+        int old_inum = dst->inum;
+        inode_t *old = get_inode(old_inum);
+        inode_t *moved = get_inode(inum);
+
+        if (S_ISDIR(old->mode) && !S_ISDIR(moved->mode)) {
+            return -EISDIR;
+        }
+        if (!S_ISDIR(old->mode) && S_ISDIR(moved->mode)) {
+            return -ENOTDIR;
+        }
+        if (S_ISDIR(old->mode) && !directory_empty(old)) {
+            return -ENOTEMPTY;
+        }
+
+        // The target name takes over the moved inode
+        dst->inum = inum;
+        dst->type = src->type;
+        directory_remove(from_dir, from);
+
+        // The replaced file loses a reference
+        old->refs--;
+        if (old->refs <= 0) {
+            free_inode(old_inum);
+        }
+        return 0;
     }
 
-    // Return an error code if the directory is not found
-    return -ENOENT;
+    // Within a plain directory only the name of the entry changes
+    if (from_dir == to_dir && !(from_dir->flags & INODE_ORDERED)) {
+        int slot = directory_find(from_dir, from);
+        dirblock_t *db = directory_block(from_dir, slot / DIRENTS_PER_BLOCK);
+        int i = slot % DIRENTS_PER_BLOCK;
+
+        strncpy(db->entries[i].name, to, DIR_NAME_LENGTH);
+        db->hashes[i] = directory_hash(to);
+        return 0;
+    }
+
+    // Add the new name before dropping the old one, so the inode always has one
+    int rv = directory_put(to_dir, to, inum);
+    if (rv < 0) {
+        return rv;
+    }
+    directory_remove(from_dir, from);
+
+    return 0;
+}
+
+/**
+ * Checks whether a directory has no entries.
+ *
+ * The inode counts the live entries, so no block is read.
+ *
+ * @param di Pointer to the inode of the directory.
+ * @return 1 if the directory is empty, 0 otherwise.
+ */
+int directory_empty(inode_t *di) {
+    return di->entries == 0;
+}
+
+/**
+ * Finds the next entry of a directory walk.
+ *
+ * In a plain directory slots never move once an entry is stored in them, so
+ * the slot number is a stable cookie that a caller can use to resume a walk.
+ * An ordered directory returns its entries in name order and resumes after
+ * the last name returned, so entries added or removed during the walk do not
+ * shift the others.
+ *
+ * @param di Pointer to the inode of the directory to walk.
+ * @param cur The walk position; advanced past the returned entry.
+ * @return Pointer to the entry, or NULL once the end of the directory is reached.
+ */
+dirent_t *directory_next(inode_t *di, dir_cursor_t *cur) {
+
+    if (di->flags & INODE_ORDERED) {
+        dirent_t *entry = btree_next(di, cur->last, 0);
+        if (entry) {
+            memcpy(cur->last, entry->name, DIR_NAME_LENGTH);
+            cur->slot++;
+        }
+        return entry;
+    }
+
+    // Number of blocks in the directory
+    int blocks = di->size / BLOCK_SIZE;
+
+    for (int b = cur->slot / DIRENTS_PER_BLOCK; b < blocks; ++b) {
+        dirblock_t *db = directory_block(di, b);
+
+        // Used slots of this block at or after the starting one
+        uint64_t used = db->used;
+        if (b == cur->slot / DIRENTS_PER_BLOCK) {
+            used &= ~(((uint64_t) 1 << (cur->slot % DIRENTS_PER_BLOCK)) - 1);
+        }
+
+        if (used) {
+            int i = __builtin_ctzll(used);
+
+            // Resume right after this entry next time
+            cur->slot = b * DIRENTS_PER_BLOCK + i + 1;
+            return &db->entries[i];
+        }
+    }
+
+    // Nothing left in the directory
+    cur->slot = blocks * DIRENTS_PER_BLOCK;
+    return NULL;
+}
+
+/**
+ * Moves a directory walk to the given slot.
+ *
+ * Nothing happens if the walk is already there. Otherwise plain directories
+ * jump straight to the slot, while ordered ones count entries from the start.
+ *
+ * @param di Pointer to the inode of the directory.
+ * @param cur The walk position.
+ * @param slot The slot (or rank) to move to.
+ */
+void directory_seek(inode_t *di, dir_cursor_t *cur, int slot) {
+
+    if (cur->slot == slot) {
+        return;
+    }
+
+    cur->slot = 0;
+    memset(cur->last, 0, DIR_NAME_LENGTH);
+
+    if (!(di->flags & INODE_ORDERED)) {
+        cur->slot = slot;
+        return;
+    }
+
+    while (cur->slot < slot && directory_next(di, cur) != NULL) {
+    }
+}
+
+/**
+ * Turns an empty directory into an ordered one.
+ *
+ * @param di Pointer to the inode of the directory.
+ * @return 0 on success, or -ENOTEMPTY if the directory has entries.
+ */
+int directory_set_ordered(inode_t *di) {
+
+    if (di->flags & INODE_ORDERED) {
+        return 0;
+    }
+
+    if (!directory_empty(di)) {
+        return -ENOTEMPTY;
+    }
+
+    // Drop the plain directory blocks, the B+tree starts from nothing
+    shrink_inode(di, 0);
+    di->flags |= INODE_ORDERED;
+
+    return 0;
+}
+
+/**
+ * Lists a range of an ordered directory in name order.
+ *
+ * Only the entries in the range are visited, so the caller can page through
+ * a huge directory by passing the last name it got as the next after.
+ *
+ * @param di Pointer to the inode of the directory.
+ * @param after List names greater than this ("" for no lower bound).
+ * @param before List names less than this ("" for no upper bound).
+ * @param prefix List only names starting with this ("" for all names).
+ * @param out Receives the entries.
+ * @param max Room in out.
+ * @return The number of entries stored, or -EINVAL for a plain directory.
+ */
+int directory_range(inode_t *di, const char *after, const char *before,
+                    const char *prefix, dirent_t *out, int max) {
+
+    if (!(di->flags & INODE_ORDERED)) {
+        return -EINVAL;
+    }
+
+    int prefix_len = strnlen(prefix, DIR_NAME_LENGTH);
+
+    // Start at whichever comes later, the prefix or the name to skip past
+    char key[DIR_NAME_LENGTH];
+    int inclusive = strncmp(prefix, after, DIR_NAME_LENGTH) > 0;
+    strncpy(key, inclusive ? prefix : after, DIR_NAME_LENGTH);
+
+    int count = 0;
+    dirent_t *entry;
+    while (count < max && (entry = btree_next(di, key, inclusive)) != NULL) {
+
+        // Past the end of the range
+        if (strncmp(entry->name, prefix, prefix_len) != 0 ||
+            (before[0] && strncmp(entry->name, before, DIR_NAME_LENGTH) >= 0)) {
+            break;
+        }
+
+        out[count++] = *entry;
+        memcpy(key, entry->name, DIR_NAME_LENGTH);
+        inclusive = 0;
+    }
+
+    return count;
 }
 
 /**
@@ -199,24 +804,27 @@ slist_t *directory_list(const char *path) {
 
     // get the inum of the directory
     int dir_inum = path_lookup(path);
+    if (dir_inum < 0) {
+        return NULL;
+    }
 
     // get the inode
     inode_t *dir_inode = get_inode(dir_inum);
-
-    // Number of entries in the directoy 
-    int entries = dir_inode->size / sizeof(dirent_t);
-    dirent_t *directory_entries = blocks_get_block(dir_inode->pointers[0]);
+    inode_rdlock(dir_inum);
 
     // Initialize an empty directory list
     slist_t *new_dir = NULL;
 
-    // Updae the directory list
-    for (int i = 0; i < entries; ++i) {
-        if (directory_entries[i].input_allocation) {
-            // Add the entry name to the list
-            new_dir = s_cons(directory_entries[i].name, new_dir);
-        }
+    // Updae the directory list, keeping the directory's order
+    slist_t **tail = &new_dir;
+    dir_cursor_t cur = { 0 };
+    dirent_t *entry;
+    while ((entry = directory_next(dir_inode, &cur)) != NULL) {
+        // Add the entry name to the list
+        *tail = s_cons(entry->name, NULL);
+        tail = &(*tail)->next;
     }
+    inode_unlock(dir_inum);
 
     // Return the lst of directory entries
     return new_dir;
@@ -230,12 +838,10 @@ slist_t *directory_list(const char *path) {
  */
 void print_directory(inode_t *dd) {
 
-    // Number of entries in the directoy 
-    int entries = dd->size / sizeof(dirent_t);
-    dirent_t *directory_entries = blocks_get_block(dd->pointers[0]);
-
     //print the entries present in the directory
-    for (int i = 0; i < entries; ++i) {
-        printf(" %s\n", directory_entries[i].name);
+    dir_cursor_t cur = { 0 };
+    dirent_t *entry;
+    while ((entry = directory_next(dd, &cur)) != NULL) {
+        printf(" %s\n", entry->name);
     }
-}
\ No newline at end of file
+}
@@ -8,6 +8,27 @@
 
 #define DIR_NAME_LENGTH 48
 
+// Flags for directory_rename, as in renameat2(2)
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0)
+#endif
+#ifndef RENAME_EXCHANGE
+#define RENAME_EXCHANGE (1 << 1)
+#endif
+
+// Number of entries held by one directory block
+#define DIRENTS_PER_BLOCK 56
+
+// Value of dirblock_t.used when every slot of the block is taken
+#define DIRBLOCK_FULL ((((uint64_t) 1) << DIRENTS_PER_BLOCK) - 1)
+
+// Entry types are the file type bits of the inode mode, the same values as
+// the DT_* constants of d_type (0 means unknown, e.g. for old entries)
+#define DIRENT_TYPE(mode) (((mode) & 0170000) >> 12)
+#define DIRENT_MODE(type) ((type) << 12)
+
+#include <stdint.h>
+
 #include "blocks.h"
 #include "inode.h"
 #include "slist.h"
@@ -16,14 +37,43 @@ typedef struct dirent {
   char name[DIR_NAME_LENGTH];
   int inum;
   char input_allocation;
-  char _reserved[12];
+  char type; // file type of the entry, see DIRENT_TYPE
+  char _reserved[11];
 } dirent_t;
 
+// Position of a walk over a directory (see directory_next)
+typedef struct dir_cursor {
+  int slot;                   // slot of the next entry (its rank in ordered directories)
+  char last[DIR_NAME_LENGTH]; // name of the last entry returned (ordered directories)
+} dir_cursor_t;
+
+// Layout of a directory block. The name hashes live in their own array in
+// front of the entries so lookups can compare several of them at once.
+// A directory is size / BLOCK_SIZE of these; slot s of the directory is
+// entry s % DIRENTS_PER_BLOCK of block s / DIRENTS_PER_BLOCK.
+typedef struct dirblock {
+  uint64_t used; // bit i is set if slot i holds an entry
+  int free_hint; // first block that may have a free slot (kept in block 0)
+  int _reserved;
+  uint32_t hashes[DIRENTS_PER_BLOCK]; // name hash per slot, 0 if the slot is free
+  dirent_t entries[DIRENTS_PER_BLOCK];
+} dirblock_t;
+
 void directory_init();
 int directory_lookup(inode_t *di, const char *name);
 int path_lookup(const char *path);
 int directory_put(inode_t *di, const char *name, int inum);
+int directory_put_batch(inode_t *di, const dirent_t *entries, int count);
 int directory_delete(inode_t *di, const char *name);
+int directory_delete_tree(inode_t *di, const char *name);
+int directory_rename(inode_t *from_dir, const char *from, inode_t *to_dir,
+                     const char *to, unsigned int flags);
+int directory_empty(inode_t *di);
+dirent_t *directory_next(inode_t *di, dir_cursor_t *cur);
+void directory_seek(inode_t *di, dir_cursor_t *cur, int slot);
+int directory_set_ordered(inode_t *di);
+int directory_range(inode_t *di, const char *after, const char *before,
+                    const char *prefix, dirent_t *out, int max);
 slist_t *directory_list(const char *path);
 void print_directory(inode_t *dd);
 
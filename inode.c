@@ -2,12 +2,94 @@
 #include <stdlib.h>
 #include <time.h>
 #include <assert.h>
+#include <errno.h>
+#include <pthread.h>
 #include "inode.h"
 #include "blocks.h"
 #include "bitmap.h"
 
 
+// One lock per inode, see inode.h
+static pthread_rwlock_t *inode_locks = NULL;
 
+// Inode locks this thread holds, and whether any of them is a write lock.
+// Blocks got under them are put back once the last one is unlocked.
+static __thread int inode_held = 0;
+static __thread int inode_held_write = 0;
+
+// Blocks reserved to follow each inode's last block as it grows, handed out
+// in order. Kept in memory only.
+typedef struct inode_window {
+    int next;  // the next block to hand out
+    int count; // blocks left
+    int size;  // blocks asked for last time, 0 while the file is not growing
+} inode_window_t;
+
+static inode_window_t *inode_windows = NULL;
+
+// References held from outside the disk (the kernel's lookup counts), per
+// inode. Kept in memory only; updated atomically, since the kernel looks up
+// an inode under its directory's lock only.
+static uint64_t *inode_pins = NULL;
+
+/**
+ * Sets up the in-memory state kept for each inode: its lock, preallocation
+ * window and pins. Called once, before any other thread runs.
+ */
+void inode_init() {
+    inode_locks = malloc(BLOCK_COUNT * sizeof(pthread_rwlock_t));
+    inode_windows = calloc(BLOCK_COUNT, sizeof(inode_window_t));
+    inode_pins = calloc(BLOCK_COUNT, sizeof(uint64_t));
+    assert(inode_locks && inode_windows && inode_pins);
+
+    for (int i = 0; i < BLOCK_COUNT; ++i) {
+        pthread_rwlock_init(&inode_locks[i], NULL);
+    }
+}
+
+/**
+ * Counts one more inode lock held by this thread. Blocks got while holding
+ * none are put back first, dirty to be safe.
+ */
+static void inode_hold() {
+    if (inode_held++ == 0) {
+        blocks_put_held(1);
+    }
+}
+
+/**
+ * Locks an inode for reading: looking at its fields, data or entries.
+ *
+ * @param inum The inode number.
+ */
+void inode_rdlock(int inum) {
+    inode_hold();
+    pthread_rwlock_rdlock(&inode_locks[inum]);
+}
+
+/**
+ * Locks an inode for changing it.
+ *
+ * @param inum The inode number.
+ */
+void inode_wrlock(int inum) {
+    inode_hold();
+    inode_held_write = 1;
+    pthread_rwlock_wrlock(&inode_locks[inum]);
+}
+
+/**
+ * Unlocks an inode locked with inode_rdlock or inode_wrlock.
+ *
+ * @param inum The inode number.
+ */
+void inode_unlock(int inum) {
+    if (--inode_held == 0) {
+        blocks_put_held(inode_held_write);
+        inode_held_write = 0;
+    }
+    pthread_rwlock_unlock(&inode_locks[inum]);
+}
 
 /**
  * Prints information about the given inode.
@@ -55,33 +137,75 @@ inode_t *get_inode(int inum) {
  */
 int alloc_inode() {
 
-    // Get the bitmap for the inode
-    void *curr_bitmap = get_inode_bitmap();
-
-    // mock index
-    int node_index = -1;
-
-    // Allocating a block
-    for (int i = 0; i < BLOCK_COUNT; ++i) {
+    // Take the first free inode
+    int node_index = alloc_inode_bit();
 
-        if(bitmap_get(curr_bitmap, i) == 0) {
-            bitmap_put(curr_bitmap, i, 1);
-            node_index = i;
-            break;
-        }
+    // No free inode left
+    if (node_index < 0) {
+        return -1;
     }
 
-    // New inode
+    // New inode, locked for whoever still holds its number from before it
+    // was last freed
     inode_t *inode = get_inode(node_index);
+    inode_wrlock(node_index);
     inode->refs = 1;
     inode->mode = 0;
     inode->size = 0;
-    inode->pointers[0] = alloc_block();
+    inode->block = 0;
+    inode->flags = 0;
+    inode->entries = 0;
+    inode->parent = 0;
+    inode->pointers[0] = alloc_block() | INODE_UNWRITTEN;
+    inode->pointers[1] = 0;
+    inode_unlock(node_index);
 
     return node_index;
 
 }
 
+/**
+ * Pins an inode, so that it is not freed while its last link goes away.
+ *
+ * @param inum The inode to pin.
+ * @param count The number of references to add.
+ */
+void inode_pin(int inum, uint64_t count) {
+    __atomic_add_fetch(&inode_pins[inum], count, __ATOMIC_RELAXED);
+}
+
+/**
+ * Drops references taken with inode_pin. An inode that lost its last link
+ * while it was pinned is freed once the last reference goes. Takes the
+ * inode's lock, so that it is never freed both here and by its last unlink.
+ *
+ * @param inum The inode to unpin.
+ * @param count The number of references to drop.
+ */
+void inode_unpin(int inum, uint64_t count) {
+    inode_wrlock(inum);
+
+    uint64_t pins = __atomic_fetch_sub(&inode_pins[inum], count, __ATOMIC_RELAXED);
+    assert(pins >= count);
+
+    if (pins == count && get_inode(inum)->refs <= 0) {
+        free_inode(inum);
+    }
+
+    inode_unlock(inum);
+}
+
+/**
+ * Drops every pin, freeing the inodes that were only kept for them.
+ */
+void inode_unpin_all() {
+    for (int i = 0; i < BLOCK_COUNT; ++i) {
+        if (inode_pins[i] > 0) {
+            inode_unpin(i, inode_pins[i]);
+        }
+    }
+}
+
 /**
  * Frees an inode.
  *
@@ -89,19 +213,26 @@ int alloc_inode() {
  */
 void free_inode(int inum) {
 
-    // Get the bitmap for the inode
-    void *curr_bitmap = get_inode_bitmap();
+    // Still pinned: it is freed by the last inode_unpin instead
+    if (__atomic_load_n(&inode_pins[inum], __ATOMIC_RELAXED) > 0) {
+        return;
+    }
 
     inode_t *inode_delete = get_inode(inum);
 
     // Shrink the inode size to 0
     shrink_inode(inode_delete, 0);
+    inode_release_window(inum);
 
     // Free the block associated with this inode
-    free_block(inode_delete->pointers[0]);
+    free_block(inode_delete->pointers[0] & ~INODE_UNWRITTEN);
+    inode_delete->pointers[0] = 0;
+
+    // Whoever still holds its number finds it gone once they lock it
+    inode_delete->mode = 0;
 
     // Free the inode in the bitmap
-    bitmap_put(curr_bitmap, inum, 0);
+    free_inode_bit(inum);
 
     // Ensure the indode's size is set to 0
     assert(inode_delete->size == 0);
@@ -109,38 +240,213 @@ void free_inode(int inum) {
 
 
 /**
- * Grows an inode to the specified size, allocating additional blocks as needed.
+ * Returns the number of blocks an inode of the given size holds.
  *
- * @param node Pointer to the inode to grow.
- * @param size The new size of the inode.
- * @return 0 on success.
+ * The first block is allocated along with the inode, so even an empty
+ * inode holds one.
  *
+ * @param size The size of the inode in bytes.
+ * @return The number of blocks.
  */
-int grow_inode(inode_t *node, int size) {
+static int inode_blocks(int size) {
+    int blocks = bytes_to_blocks(size);
+    return blocks < 1 ? 1 : blocks;
+}
+
+/**
+ * Returns where the pointer to a block of an inode is kept: in the inode for
+ * the first two, in the indirect block after that.
+ *
+ * @param node Pointer to the inode.
+ * @param index The block index in the file.
+ * @return Pointer to the block pointer, flags included.
+ */
+static int *inode_pointer(inode_t *node, int index) {
+    if (index >= 2) {
+        int *indirect = blocks_get_block(node->block);
+        return &indirect[index - 2];
+    }
+    return &node->pointers[index];
+}
+
+/**
+ * Frees the blocks with indices [from, to) of an inode.
+ *
+ * Also frees the indirect block once no index past the direct pointers is
+ * left in use.
+ *
+ * @param node Pointer to the inode.
+ * @param from The first block index to free.
+ * @param to One past the last block index to free.
+ */
+static void inode_free_blocks(inode_t *node, int from, int to) {
+
+    for (int i = to - 1; i >= from; i--) {
+        int *pointer = inode_pointer(node, i);
+        free_block(*pointer & ~INODE_UNWRITTEN);
+        *pointer = 0;
+    }
+
+    // Drop the indirect block once nothing lives behind it
+    if (from <= 2 && node->block != 0) {
+        free_block(node->block);
+        node->block = 0;
+    }
+}
+
+/**
+ * Returns the number of an inode from its place in the inode table.
+ *
+ * @param node Pointer to the inode.
+ * @return The inode number.
+ */
+static int inode_number(inode_t *node) {
+    return node - get_inode(0);
+}
+
+/**
+ * Allocates the next block of a growing inode, from its preallocation window
+ * if it has one.
+ *
+ * @param node Pointer to the inode.
+ * @return The block number, or -1 if the disk is full.
+ */
+static int inode_alloc_block(inode_t *node) {
+    inode_window_t *window = &inode_windows[inode_number(node)];
+
+    while (window->count > 0) {
+        int bnum = window->next++;
+        window->count--;
+
+        // Fails for blocks alloc_block took back when the disk filled up
+        if (blocks_claim(bnum)) {
+            return bnum;
+        }
+    }
 
-    // Get the current size of the node
-    int curr_size = (node->size / BLOCK_SIZE) + 1;
+    return alloc_block();
+}
+
+/**
+ * Reserves the next preallocation window for a growing inode, starting right
+ * after the given block if it can, so that the file stays contiguous. Each
+ * window asks for twice as many blocks as the one before, from
+ * INODE_PREALLOC_MIN up to INODE_PREALLOC_MAX.
+ *
+ * @param node Pointer to the inode.
+ * @param after The block the window should follow.
+ */
+static void inode_reserve_window(inode_t *node, int after) {
+    inode_window_t *window = &inode_windows[inode_number(node)];
+    if (window->size == 0) {
+        window->size = INODE_PREALLOC_MIN;
+    } else if (window->size < INODE_PREALLOC_MAX) {
+        window->size *= 2;
+    }
+
+    window->count = blocks_reserve(after, window->size, &window->next);
+}
+
+/**
+ * Gives back what is left of an inode's preallocation window, e.g. once the
+ * file is closed, and starts the next window small again.
+ *
+ * @param inum The inode number.
+ */
+void inode_release_window(int inum) {
+    inode_window_t *window = &inode_windows[inum];
+
+    if (window->count > 0) {
+        blocks_unreserve(window->next, window->count);
+    }
+    window->count = 0;
+    window->size = 0;
+}
 
-    // How much size we will need
-    int size_needed = size / BLOCK_SIZE;
+/**
+ * Gives an inode the blocks with indices [from, to), each marked unwritten.
+ *
+ * @param node Pointer to the inode.
+ * @param from The first block index to add.
+ * @param to One past the last block index to add.
+ * @param reserve Nonzero to reserve a preallocation window when the inode
+ * needs a block and has none.
+ * @return 0 on success, or -ENOSPC if the disk is full (nothing is added).
+ */
+static int inode_add_blocks(inode_t *node, int from, int to, int reserve) {
 
-    for (int i = curr_size; i <= size_needed; ++i) {
+    for (int i = from; i < to; ++i) {
 
         // Checking if we have already allocated the maximum number of pointers 
-        if (i >= 2) {
-            if (node->block == 0) {
-                // Allocate a new block as there is nothing present in the main block
-                node->block = alloc_block();
+        if (i >= 2 && node->block == 0) {
+            // Allocate the indirect block for the first large-file page
+            node->block = alloc_block();
+            if (node->block < 0) {
+                node->block = 0;
+                inode_free_blocks(node, from, i);
+                return -ENOSPC;
             }
-            // Retrieve the current main pointer so we can allocate a new page (Large Files)
-            int *current_pointer = blocks_get_block(node->block);
-            current_pointer[i-2] = alloc_block();
         }
-        else {
-            // We have space avaliable in the block so we allocate into it
-            node->pointers[i] = alloc_block();
+
+        inode_window_t *window = &inode_windows[inode_number(node)];
+        if (reserve && i > 0 && window->count == 0) {
+            inode_reserve_window(node, inode_get_bnum(node, (i - 1) * BLOCK_SIZE));
+        }
+
+        int bnum = inode_alloc_block(node);
+        if (bnum < 0) {
+            // Give back what this call took
+            inode_free_blocks(node, from, i);
+            return -ENOSPC;
+        }
+
+        // Whatever the block held before is not part of the file
+        *inode_pointer(node, i) = bnum | INODE_UNWRITTEN;
+    }
+
+    return 0;
+}
+
+/**
+ * Zeroes what is left past the end of an inode in the last block it holds,
+ * so that it reads as zeros once the inode grows over it.
+ *
+ * @param node Pointer to the inode.
+ */
+static void inode_zero_tail(inode_t *node) {
+    int last = node->size / BLOCK_SIZE;
+
+    if (last < inode_blocks(node->size) && !inode_is_unwritten(node, node->size)) {
+        int tail = node->size % BLOCK_SIZE;
+        if (tail == 0) {
+            *inode_pointer(node, last) |= INODE_UNWRITTEN;
+        } else {
+            blocks_zero((off_t) inode_get_bnum(node, node->size) * BLOCK_SIZE + tail,
+                        BLOCK_SIZE - tail);
         }
     }
+}
+
+/**
+ * Grows an inode to the specified size, allocating additional blocks as needed.
+ *
+ * @param node Pointer to the inode to grow.
+ * @param size The new size of the inode.
+ * @return 0 on success, or -ENOSPC if the disk is full (the inode is unchanged).
+ *
+ */
+int grow_inode(inode_t *node, int size) {
+
+    if (size <= node->size) {
+        node->size = size;
+        return 0;
+    }
+
+    inode_zero_tail(node);
+
+    if (inode_add_blocks(node, inode_blocks(node->size), inode_blocks(size), 0) < 0) {
+        return -ENOSPC;
+    }
 
     // Update the current inode size to include the addition
     node->size = size;
@@ -149,6 +455,46 @@ int grow_inode(inode_t *node, int size) {
 
 }
 
+/**
+ * Grows an inode for a write past its end. Like grow_inode, but new blocks
+ * come from a preallocation window reserved after the last block, so that
+ * files growing at the same time do not end up with their blocks interleaved.
+ *
+ * @param node Pointer to the inode to grow.
+ * @param size The new size of the inode.
+ * @return 0 on success, or -ENOSPC if the disk is full (the inode is unchanged).
+ */
+int inode_extend(inode_t *node, int size) {
+
+    inode_zero_tail(node);
+
+    if (inode_add_blocks(node, inode_blocks(node->size), inode_blocks(size), 1) < 0) {
+        return -ENOSPC;
+    }
+
+    node->size = size;
+    return 0;
+}
+
+/**
+ * Grows an inode for an append, which writes everything from the old size to
+ * the new one. Like inode_extend, except that nothing past the old size is
+ * zeroed.
+ *
+ * @param node Pointer to the inode to grow.
+ * @param size The new size of the inode.
+ * @return 0 on success, or -ENOSPC if the disk is full (the inode is unchanged).
+ */
+int inode_append(inode_t *node, int size) {
+
+    if (inode_add_blocks(node, inode_blocks(node->size), inode_blocks(size), 1) < 0) {
+        return -ENOSPC;
+    }
+
+    node->size = size;
+    return 0;
+}
+
 /**
  * Shrinks an inode to the specified size, freeing extra block pointers if required.
  *
@@ -160,38 +506,8 @@ int grow_inode(inode_t *node, int size) {
  */
 int shrink_inode(inode_t *node, int size) {
 
-    // Get the current size of the node
-    int curr_size = (node->size / BLOCK_SIZE) + 1;
-
-    // How much size current is in relation to the BLOCK_SIZE
-    int size_needed = size / BLOCK_SIZE;
-
-    for (int i = curr_size; i >= size_needed; i--) {
-        // Similar approach to grow_inode just opposite
-        // Checking if we have already allocated the maximum number of pointers 
-        if (i >= 2) {
-            // Retrieve the current main pointer so we can allocate a new page (Large Files)
-            int *current_pointer = blocks_get_block(node->block);
-            int curr_point = current_pointer[i-2];
-
-            // Free the current block
-            free_block(curr_point);
-            curr_point = 0;
-
-            // Check to see if we deallocated everything requiored
-            if (i == 2) {
-                // Free block in the main pointer
-                free_block(node->block);
-                node->block = 0;
-            }
-
-        }
-        else {
-            // Free the blocks currently in the pointer
-            free_block(node->pointers[i]);
-            node->pointers[i] = 0;
-        }
-    }
+    // Free every block past the ones the new size needs
+    inode_free_blocks(node, inode_blocks(size), inode_blocks(node->size));
     
     // Update the current inode size to include the addition
     node->size = size;
@@ -208,19 +524,29 @@ int shrink_inode(inode_t *node, int size) {
  */
 int inode_get_bnum(inode_t *node, int file_bnum) {
 
-    // Get the current pointer
-    int curr_pointer = file_bnum / BLOCK_SIZE;
+    return *inode_pointer(node, file_bnum / BLOCK_SIZE) & ~INODE_UNWRITTEN;
+}
 
-    // Check to see if the pointer is in the block
-    if (curr_pointer >= 2) {
-        int *curr_block_pointer = blocks_get_block(node->block);
-        return curr_block_pointer[curr_pointer - 2];
-    }
-    else {
-        // return the block number 
-        return node->pointers[curr_pointer];
-    }
+/**
+ * Checks whether the block holding a file offset has never been written.
+ *
+ * @param node Pointer to the inode.
+ * @param offset The offset in the file.
+ * @return 1 if the block reads as zeros, 0 otherwise.
+ */
+int inode_is_unwritten(inode_t *node, int offset) {
+    return (*inode_pointer(node, offset / BLOCK_SIZE) & INODE_UNWRITTEN) != 0;
+}
 
+/**
+ * Marks the block holding a file offset as written. Its contents are then
+ * read as they are, so the caller must have filled all of it.
+ *
+ * @param node Pointer to the inode.
+ * @param offset The offset in the file.
+ */
+void inode_set_written(inode_t *node, int offset) {
+    *inode_pointer(node, offset / BLOCK_SIZE) &= ~INODE_UNWRITTEN;
 }
 
 
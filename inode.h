@@ -6,24 +6,73 @@
 #ifndef INODE_H
 #define INODE_H
 
+#include <stdint.h>
+
 #include "blocks.h"
 
+// The inode table is part of the image, so a change to this struct is a
+// change of format, see STORAGE_VERSION in storage.c
 typedef struct inode {
   int refs;  // reference count
   int mode;  // permission & type
   int size;  // bytes
   int block; // single block pointer (if max file size <= 4K)
   int pointers[2]; // Multi block pointers used for large files
+  int flags; // INODE_* flags
+  int entries; // live entries (directories only)
+  int parent;  // inum of the parent directory (directories only)
 
 } inode_t;
 
+_Static_assert(sizeof(inode_t) == 36, "inode_t is on disk: bump STORAGE_VERSION");
+
+#define INODE_ORDERED 1 // directory kept as a B+tree ordered by name (btree.h)
+
+// Set in a block pointer while the block has never been written; the file
+// reads as zeros there, whatever the block held before
+#define INODE_UNWRITTEN (1 << 30)
+
+// Preallocation window bounds, in blocks, for files being written past the end
+#define INODE_PREALLOC_MIN 4
+#define INODE_PREALLOC_MAX 32
+
+// Locking. Every inode has a reader-writer lock, held across any use of its
+// fields or, for a directory, its entries; the storage_* functions take the
+// locks themselves. The inode_* and directory_* functions leave locking to
+// their callers, except for inode_unpin, path_lookup and directory_list.
+// An inode freed while its number was held unlocked reads as mode 0.
+//
+// Locks are taken in this order, and none is held across a reply to FUSE
+// except an inode's read lock while its data is sent:
+//  1. the rename lock (storage.c), for moves between directories
+//  2. directories, each before anything below it; two directories that are
+//     not one inside the other in inode number order
+//  3. an open file's write buffer lock, one at a time (nufs.c); the list
+//     of handles with buffered writes is locked only briefly under it
+//  4. the inodes that are not directories, in inode number order
+//  5. the block allocation group locks and the inode bitmap lock
+//     (blocks.c), one at a time
+// Block cache shards (bcache.c) come last of all.
+
+void inode_init();
 void print_inode(inode_t *node);
 inode_t *get_inode(int inum);
 int alloc_inode();
 void free_inode();
 int grow_inode(inode_t *node, int size);
+int inode_extend(inode_t *node, int size);
+int inode_append(inode_t *node, int size);
+void inode_release_window(int inum);
 int shrink_inode(inode_t *node, int size);
 int inode_get_bnum(inode_t *node, int file_bnum);
+int inode_is_unwritten(inode_t *node, int offset);
+void inode_set_written(inode_t *node, int offset);
 void shrink_references(int inum);
+void inode_pin(int inum, uint64_t count);
+void inode_unpin(int inum, uint64_t count);
+void inode_unpin_all();
+void inode_rdlock(int inum);
+void inode_wrlock(int inum);
+void inode_unlock(int inum);
 
 #endif
@@ -10,13 +10,294 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
 
+// Builds against FUSE 2.6 by default; pass -DFUSE_USE_VERSION=30 for FUSE 3,
+// and also -DNUFS_LOWLEVEL to run the low-level frontend in nufs_ll.c.
+#ifndef FUSE_USE_VERSION
 #define FUSE_USE_VERSION 26
+#endif
+#if defined(NUFS_LOWLEVEL) && FUSE_USE_VERSION < 30
+#error "the low-level frontend needs FUSE 3"
+#endif
 #include <fuse.h>
 
 #include "inode.h"
 #include "directory.h"
 #include "storage.h"
+#include "nufs_ioctl.h"
+#include "nufs.h"
+
+_Static_assert(NUFS_NAME_MAX == DIR_NAME_LENGTH, "ioctl names are dirent names");
+
+// Handles with buffered writes, so that whatever looks at an inode can have
+// them written out first. nufs_wb_lock covers only the list and the wb_users
+// and wb_detached fields; it is held briefly, with no other lock taken under
+// it. Each handle's own wb_lock covers its buffer and is held while the
+// buffer is written out, see inode.h.
+static nufs_file_t *nufs_dirty = NULL;
+static pthread_mutex_t nufs_wb_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Attach a new file handle for the given inode to fi.
+int nufs_file_attach(int inum, struct fuse_file_info *fi) {
+  nufs_file_t *file = calloc(1, sizeof(nufs_file_t));
+  if (file == NULL) {
+    return -ENOMEM;
+  }
+  file->inum = inum;
+  pthread_mutex_init(&file->wb_lock, NULL);
+  fi->fh = (uintptr_t) file;
+
+  // All writes reach the image through the kernel, so the pages it already
+  // has for the file are still good
+  fi->keep_cache = 1;
+  return 0;
+}
+
+static void nufs_file_free(nufs_file_t *file) {
+  pthread_mutex_destroy(&file->wb_lock);
+  free(file->wb_data);
+  free(file);
+}
+
+// Drop the handle when the file is closed, after writing out what it has
+// buffered. The blocks preallocated for the file to grow into go back too:
+// it is done growing, at least for now. Returns the error of any buffered
+// write that failed. A flush of the inode that still uses the handle frees
+// it once done.
+int nufs_file_detach(struct fuse_file_info *fi) {
+  nufs_file_t *file = (nufs_file_t *) (uintptr_t) fi->fh;
+
+  int rv = nufs_file_flush(fi);
+  inode_wrlock(file->inum);
+  inode_release_window(file->inum);
+  inode_unlock(file->inum);
+
+  pthread_mutex_lock(&nufs_wb_lock);
+  file->wb_detached = 1;
+  int unused = file->wb_users == 0;
+  pthread_mutex_unlock(&nufs_wb_lock);
+
+  if (unused) {
+    nufs_file_free(file);
+  }
+  return rv;
+}
+
+// Whether any handle has buffered writes. A quick look without the lock,
+// for requests that would otherwise take it just to find nothing to do; a
+// write it misses is still in progress, so the request may come before it.
+static int nufs_have_dirty() {
+  return __atomic_load_n(&nufs_dirty, __ATOMIC_ACQUIRE) != NULL;
+}
+
+// Put a handle on the list of those with buffered writes, or take it off.
+static void nufs_file_list(nufs_file_t *file, int dirty) {
+  pthread_mutex_lock(&nufs_wb_lock);
+  if (dirty) {
+    file->wb_prev = NULL;
+    file->wb_next = nufs_dirty;
+    if (nufs_dirty) {
+      nufs_dirty->wb_prev = file;
+    }
+    __atomic_store_n(&nufs_dirty, file, __ATOMIC_RELEASE);
+  } else {
+    if (file->wb_prev) {
+      file->wb_prev->wb_next = file->wb_next;
+    } else {
+      __atomic_store_n(&nufs_dirty, file->wb_next, __ATOMIC_RELEASE);
+    }
+    if (file->wb_next) {
+      file->wb_next->wb_prev = file->wb_prev;
+    }
+  }
+  pthread_mutex_unlock(&nufs_wb_lock);
+}
+
+// Write out a handle's buffered writes, or with whole_blocks set only up to
+// the last block boundary, unless that is before all of them. The rest stays
+// buffered. A failed write drops its data, and its error is kept in
+// wb_error for the handle's next flush, fsync or release to report.
+// Called with the handle's wb_lock held.
+static int nufs_file_write_out(nufs_file_t *file, int whole_blocks) {
+  size_t size = file->wb_size;
+  size_t partial = (file->wb_offset + file->wb_size) % BLOCK_SIZE;
+  int rv = 0;
+
+  if (size == 0) {
+    return 0;
+  }
+  if (whole_blocks && partial < size) {
+    size -= partial;
+  }
+
+  rv = storage_write_inode(file->inum, file->wb_data, size, file->wb_offset);
+  memmove(file->wb_data, file->wb_data + size, file->wb_size - size);
+  file->wb_offset += size;
+  file->wb_size -= size;
+
+  if (rv < 0 && file->wb_error == 0) {
+    file->wb_error = rv;
+  }
+  if (file->wb_size == 0) {
+    nufs_file_list(file, 0);
+  }
+  return rv < 0 ? rv : 0;
+}
+
+// Add a small write to a handle's buffer. Called with its wb_lock held.
+static int nufs_file_buffer(nufs_file_t *file, struct fuse_bufvec *src,
+                            off_t offset) {
+  size_t size = fuse_buf_size(src);
+  int rv = 0;
+
+  if (file->wb_size > 0 && (offset != file->wb_offset + (off_t) file->wb_size ||
+                            file->wb_size + size > NUFS_WBUF_SIZE)) {
+    rv = nufs_file_write_out(file, 0);
+    if (rv < 0) {
+      file->wb_error = 0; // Reported by this write instead
+      return rv;
+    }
+  }
+
+  if (file->wb_data == NULL) {
+    file->wb_data = malloc(NUFS_WBUF_SIZE);
+    if (file->wb_data == NULL) {
+      return nufs_write_bufvec(file->inum, src, offset);
+    }
+  }
+  struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+  dst.buf[0].mem = file->wb_data + file->wb_size;
+  ssize_t copied = fuse_buf_copy(&dst, src, 0);
+  if (copied <= 0) {
+    return copied;
+  }
+
+  if (file->wb_size == 0) {
+    file->wb_offset = offset;
+    nufs_file_list(file, 1);
+  }
+  file->wb_size += copied;
+
+  // Full: write out the whole blocks, keep the partial one at the end
+  if (file->wb_size > NUFS_WBUF_SIZE - NUFS_WBUF_SMALL) {
+    rv = nufs_file_write_out(file, 1);
+    if (rv < 0) {
+      file->wb_error = 0;
+    }
+  }
+  return rv < 0 ? rv : (int) copied;
+}
+
+// Write to an open file, gathering small writes that continue one another in
+// the handle's buffer. Anything else goes straight to storage, see
+// nufs_write_bufvec. Writes without a handle are never buffered.
+int nufs_file_write(int inum, struct fuse_file_info *fi, struct fuse_bufvec *src,
+                    off_t offset) {
+  nufs_file_t *file = fi ? (nufs_file_t *) (uintptr_t) fi->fh : NULL;
+  size_t size = fuse_buf_size(src);
+
+  // Buffered writes this one overlaps go first; they were written first
+  nufs_flush_inode(inum, offset, size);
+
+  if (file == NULL || size >= NUFS_WBUF_SMALL) {
+    return nufs_write_bufvec(inum, src, offset);
+  }
+
+  pthread_mutex_lock(&file->wb_lock);
+  int rv = nufs_file_buffer(file, src, offset);
+  pthread_mutex_unlock(&file->wb_lock);
+  return rv;
+}
+
+// Write out everything an open file has buffered. Returns the error of this
+// or any earlier write-out of the handle's buffer not reported yet.
+int nufs_file_flush(struct fuse_file_info *fi) {
+  nufs_file_t *file = fi ? (nufs_file_t *) (uintptr_t) fi->fh : NULL;
+  int rv = 0;
+
+  if (file) {
+    pthread_mutex_lock(&file->wb_lock);
+    nufs_file_write_out(file, 0);
+    rv = file->wb_error;
+    file->wb_error = 0;
+    pthread_mutex_unlock(&file->wb_lock);
+  }
+  return rv;
+}
+
+// Write out the buffered writes that overlap the given range of every handle
+// of an inode, or of every handle at all if inum is -1. The handles are
+// taken off the list under its lock and pinned with wb_users, so that a
+// release meanwhile leaves them to be freed here; each is then written out
+// under its own lock only.
+static void nufs_flush_files(int inum, off_t offset, size_t size) {
+  if (!nufs_have_dirty()) {
+    return;
+  }
+
+  pthread_mutex_lock(&nufs_wb_lock);
+  int count = 0;
+  for (nufs_file_t *file = nufs_dirty; file; file = file->wb_next) {
+    count += inum < 0 || file->inum == inum;
+  }
+  nufs_file_t *files[count + 1];
+  count = 0;
+  for (nufs_file_t *file = nufs_dirty; file; file = file->wb_next) {
+    if (inum < 0 || file->inum == inum) {
+      file->wb_users++;
+      files[count++] = file;
+    }
+  }
+  pthread_mutex_unlock(&nufs_wb_lock);
+
+  for (int i = 0; i < count; ++i) {
+    nufs_file_t *file = files[i];
+
+    pthread_mutex_lock(&file->wb_lock);
+    off_t end = file->wb_offset + file->wb_size;
+    if (end > offset &&
+        (file->wb_offset < offset || (size_t) (file->wb_offset - offset) < size)) {
+      nufs_file_write_out(file, 0);
+    }
+    pthread_mutex_unlock(&file->wb_lock);
+
+    pthread_mutex_lock(&nufs_wb_lock);
+    int unused = --file->wb_users == 0 && file->wb_detached;
+    pthread_mutex_unlock(&nufs_wb_lock);
+    if (unused) {
+      nufs_file_free(file);
+    }
+  }
+}
+
+// Write out the buffered writes of every handle of an inode that overlap the
+// given range, before the range is read or the inode looked at.
+void nufs_flush_inode(int inum, off_t offset, size_t size) {
+  nufs_flush_files(inum, offset, size);
+}
+
+// Write out every buffered write, e.g. before unmounting.
+void nufs_flush_all() {
+  nufs_flush_files(-1, 0, SIZE_MAX);
+}
+
+// Read ahead for an open file after a read, see storage_readahead.
+void nufs_file_readahead(struct fuse_file_info *fi, off_t offset, size_t size) {
+  if (fi && fi->fh) {
+    nufs_file_t *file = (nufs_file_t *) (uintptr_t) fi->fh;
+    storage_readahead(file->inum, &file->ra, offset, size);
+  }
+}
+
+// The inode an operation is on: the open file's, or else the path's.
+static int nufs_file_inum(const char *path, struct fuse_file_info *fi) {
+  if (fi && fi->fh) {
+    return ((nufs_file_t *) (uintptr_t) fi->fh)->inum;
+  }
+  return path_lookup(path);
+}
 
 // implementation for: man 2 access
 // Checks if a file exists.
@@ -34,7 +315,11 @@ int nufs_access(const char *path, int mask) {
 // Gets an object's attributes (type, permissions, size, etc).
 // Implementation for: man 2 stat
 // This is a crucial function.
+#if FUSE_USE_VERSION >= 30
+int nufs_getattr(const char *path, struct stat *st, struct fuse_file_info *fi) {
+#else
 int nufs_getattr(const char *path, struct stat *st) {
+#endif
   int rv = 0;
 
   // Return some metadata for the root directory...
@@ -45,6 +330,9 @@ int nufs_getattr(const char *path, struct stat *st) {
     st->st_nlink = 1;
 
   } else { // ...other files do not exist on this filesystem
+    if (nufs_have_dirty()) {
+      nufs_flush_inode(path_lookup(path), 0, SIZE_MAX);
+    }
     rv = storage_stat(path, st);
     st->st_uid = getuid();
   }
@@ -54,50 +342,114 @@ int nufs_getattr(const char *path, struct stat *st) {
   return 0;
 }
 
+// Add an entry to a readdir reply, with full attributes for readdirplus.
+static int nufs_fill(fuse_fill_dir_t filler, void *buf, const char *name,
+                     const struct stat *st, off_t off, int plus) {
+#if FUSE_USE_VERSION >= 30
+  return filler(buf, name, st, off, plus ? FUSE_FILL_DIR_PLUS : 0);
+#else
+  return filler(buf, name, st, off);
+#endif
+}
+
 // implementation for: man 2 readdir
 // lists the contents of a directory
+//
+// Entries are streamed straight out of the directory blocks. Offsets 1 and 2
+// belong to '.' and '..', the entry in slot s gets offset s + 3, so the kernel
+// can resume a listing anywhere with the offset of the last entry it saw.
+// Ordered directories list in name order and use the rank instead of the
+// slot; the cursor kept in the directory handle resumes them by name.
+//
+// A plain listing only reports the file type stored in each entry, so no
+// inode is loaded. Under FUSE 3 readdirplus requests get full attributes from
+// the inode number in the entry, which lets the kernel cache them and skip
+// the follow-up getattr. Either way no entry path is ever resolved.
+#if FUSE_USE_VERSION >= 30
+int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                 off_t offset, struct fuse_file_info *fi,
+                 enum fuse_readdir_flags flags) {
+  int plus = (flags & FUSE_READDIR_PLUS) != 0;
+#else
 int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                  off_t offset, struct fuse_file_info *fi) {
+  int plus = 0;
+#endif
   struct stat statbuf; // Stat structure to hold file/directory attributes
-  int status;          // Status of operations (e.g., getattr)
+  int inum = path_lookup(path);
 
-  slist_t *entries = storage_list(path); // Get list of directory entries
-  status = nufs_getattr(path, &statbuf); // Get attributes of the directory
-  assert(status == 0);                   // Ensure no error in getattr
+  if (inum < 0) {
+    return -ENOENT;
+  }
 
-  filler(buf, ".", &statbuf, 0); // Add current directory entry '.'
+  inode_t *dir = get_inode(inum);
+  inode_rdlock(inum);
+  int parent = dir->parent;
+  inode_unlock(inum);
 
-  // If the directory is empty, return success
-  if (entries == NULL) {
+  // Add '.' and '..' unless the kernel already has them
+  memset(&statbuf, 0, sizeof(statbuf));
+  if (storage_stat_inode(inum, &statbuf) < 0) {
+    return -ENOENT;
+  }
+  statbuf.st_uid = getuid();
+  if (offset < 1 && nufs_fill(filler, buf, ".", &statbuf, 1, plus)) {
+    return 0;
+  }
+  storage_stat_inode(parent, &statbuf);
+  if (offset < 2 && nufs_fill(filler, buf, "..", &statbuf, 2, plus)) {
     return 0;
   }
-  
-  // Iterate over each entry in the directory
-  for (slist_t *entry = entries; entry != NULL; entry = entry->next) {
-    char fullPath[strlen(path) + DIR_NAME_LENGTH + 2]; // Buffer for full path of entry
 
-    // Copy the base path
-    strncpy(fullPath, path, strlen(path));
+  // Pick up after the last entry sent
+  dir_cursor_t scratch = { .slot = -1 };
+  dir_cursor_t *cur = fi && fi->fh ? (dir_cursor_t *) (uintptr_t) fi->fh : &scratch;
+  inode_rdlock(inum);
+  directory_seek(dir, cur, offset < 2 ? 0 : offset - 2);
 
-    // Ensure the path ends with '/'
-    if (path[strlen(path) - 1] != '/') {
-      fullPath[strlen(path)] = '/';
-      fullPath[strlen(path) + 1] = 0;
+  // Iterate over each entry in the directory
+  dir_cursor_t prev = *cur;
+  dirent_t *entry;
+  while ((entry = directory_next(dir, cur)) != NULL) {
+    if (plus || entry->type == 0) {
+      // Get attributes of the entry from its inode, counting writes still
+      // sitting in a handle's buffer
+      nufs_flush_inode(entry->inum, 0, SIZE_MAX);
+      storage_stat_inode(entry->inum, &statbuf);
+    } else {
+      // The entry itself knows what kind of file it is
+      statbuf.st_ino = entry->inum;
+      statbuf.st_mode = DIRENT_MODE(entry->type);
     }
-    else {
-      fullPath[strlen(path)] = 0;
+
+    // Stop once the kernel's buffer is full; it comes back for this entry
+    if (nufs_fill(filler, buf, entry->name, &statbuf, cur->slot + 2, plus)) {
+      *cur = prev;
+      break;
     }
+    prev = *cur;
+  }
+  inode_unlock(inum);
 
-    // Concatenate the entry name to the path
-    strncat(fullPath, entry->data, DIR_NAME_LENGTH);
-  
-    // Get attributes of the entry
-    nufs_getattr(fullPath, &statbuf);
-    filler(buf, entry->data, &statbuf, 0); // Add entry to buffer
+  printf("readdir(%s, @%ld) -> 0\n", path, offset);
+  return 0;
+}
+
+// Directory handles carry the readdir cursor, so a listing read in several
+// chunks continues where the last chunk stopped.
+int nufs_opendir(const char *path, struct fuse_file_info *fi) {
+  dir_cursor_t *cur = calloc(1, sizeof(dir_cursor_t));
+  if (cur == NULL) {
+    return -ENOMEM;
   }
+  fi->fh = (uintptr_t) cur;
+  printf("opendir(%s) -> 0\n", path);
+  return 0;
+}
 
-  printf("readdir(%s) -> %d\n", path, status);
-  free(entries); // Free the memory allocated for the directory entries list
+int nufs_releasedir(const char *path, struct fuse_file_info *fi) {
+  free((dir_cursor_t *) (uintptr_t) fi->fh);
+  printf("releasedir(%s) -> 0\n", path);
   return 0;
 }
 
@@ -112,6 +464,16 @@ int nufs_mknod(const char *path, mode_t mode, dev_t rdev) {
   return rv;
 }
 
+// Create and open a file in one step, without looking it up again.
+int nufs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+  int rv = storage_create(path, mode);
+  if (rv >= 0) {
+    rv = nufs_file_attach(rv, fi);
+  }
+  printf("create(%s, %04o) -> %d\n", path, mode, rv);
+  return rv;
+}
+
 // most of the following callbacks implement
 // another system call; see section 2 of the manual
 int nufs_mkdir(const char *path, mode_t mode) {
@@ -136,20 +498,30 @@ int nufs_link(const char *from, const char *to) {
 
 int nufs_rmdir(const char *path) {
   int rv = -1;
+  rv = storage_rmdir(path);
   printf("rmdir(%s) -> %d\n", path, rv);
   return rv;
 }
 
 // implements: man 2 rename
 // called to move a file within the same filesystem
+#if FUSE_USE_VERSION >= 30
+int nufs_rename(const char *from, const char *to, unsigned int flags) {
+#else
 int nufs_rename(const char *from, const char *to) {
+  unsigned int flags = 0;
+#endif
   int rv = -1;
-  rv = storage_rename(from, to);
+  rv = storage_rename(from, to, flags);
   printf("rename(%s => %s) -> %d\n", from, to, rv);
   return rv;
 }
 
+#if FUSE_USE_VERSION >= 30
+int nufs_chmod(const char *path, mode_t mode, struct fuse_file_info *fi) {
+#else
 int nufs_chmod(const char *path, mode_t mode) {
+#endif
   int rv = -1;
 
   int inum = path_lookup(path);
@@ -159,34 +531,214 @@ int nufs_chmod(const char *path, mode_t mode) {
   }
 
   inode_t *current_inode = get_inode(inum);
+  inode_wrlock(inum);
   current_inode->mode = current_inode->mode & ~07777 & mode;
+  inode_unlock(inum);
 
   printf("chmod(%s, %04o) -> %d\n", path, mode, rv);
   return rv;
 }
 
+// FUSE 3 passes the file handle for ftruncate, if there is one
+#if FUSE_USE_VERSION >= 30
+int nufs_truncate(const char *path, off_t size, struct fuse_file_info *fi) {
+#else
 int nufs_truncate(const char *path, off_t size) {
-  int rv = -1;
-  rv = storage_truncate(path, size);
+  struct fuse_file_info *fi = NULL;
+#endif
+  int inum = nufs_file_inum(path, fi);
+  nufs_flush_inode(inum, 0, SIZE_MAX);
+  int rv = inum < 0 ? -ENOENT : storage_truncate_inode(inum, size);
   printf("truncate(%s, %ld bytes) -> %d\n", path, size, rv);
   return rv;
 }
 
-// This is called on open, but doesn't need to do much
-// since FUSE doesn't assume you maintain state for
-// open files.
-// You can just check whether the file is accessible.
+#if FUSE_USE_VERSION < 30
+int nufs_ftruncate(const char *path, off_t size, struct fuse_file_info *fi) {
+  int inum = nufs_file_inum(path, fi);
+  nufs_flush_inode(inum, 0, SIZE_MAX);
+  int rv = storage_truncate_inode(inum, size);
+  printf("ftruncate(%s, %ld bytes) -> %d\n", path, size, rv);
+  return rv;
+}
+#endif
+
+// Resolve the path once; everything done through the handle uses the inode.
 int nufs_open(const char *path, struct fuse_file_info *fi) {
-  int rv = 0;
+  int rv = path_lookup(path);
+  rv = rv < 0 ? -ENOENT : nufs_file_attach(rv, fi);
   printf("open(%s) -> %d\n", path, rv);
   return rv;
 }
 
+int nufs_release(const char *path, struct fuse_file_info *fi) {
+  int rv = nufs_file_detach(fi);
+  printf("release(%s) -> %d\n", path, rv);
+  return rv;
+}
+
+// Called on every close of the file; the buffered writes go out now, so
+// that the data is there for whoever opens the file next.
+int nufs_flush(const char *path, struct fuse_file_info *fi) {
+  int rv = nufs_file_flush(fi);
+  printf("flush(%s) -> %d\n", path, rv);
+  return rv;
+}
+
+int nufs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+  int rv = nufs_file_flush(fi);
+  int synced = blocks_fsync(datasync);
+  rv = rv < 0 ? rv : synced;
+  printf("fsync(%s) -> %d\n", path, rv);
+  return rv;
+}
+
+// What unwritten blocks of a file read as
+static char nufs_zero_block[4096];
+
+// Describe a range of a file as buffers in the image file, for the
+// low-level read. libfuse splices them to the kernel when it can, and
+// otherwise reads them into its own buffer, so nufs never copies the data
+// itself. The caller holds the inode's read lock until the data is sent.
+struct fuse_bufvec *nufs_read_bufvec(int inum, size_t size, off_t offset) {
+  int max = size / BLOCK_SIZE + 2;
+  storage_extent_t extents[max];
+  int count = storage_map_inode(inum, offset, size, extents);
+
+  struct fuse_bufvec *bufv =
+      calloc(1, sizeof(struct fuse_bufvec) + max * sizeof(struct fuse_buf));
+  if (bufv == NULL) {
+    return NULL;
+  }
+
+  bufv->count = count;
+  for (int i = 0; i < count; ++i) {
+    bufv->buf[i].size = extents[i].size;
+    if (extents[i].unwritten) {
+      // At most one block, never written: send zeros instead
+      bufv->buf[i].mem = nufs_zero_block;
+      continue;
+    }
+    bufv->buf[i].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    bufv->buf[i].fd = blocks_get_fd();
+    bufv->buf[i].pos = extents[i].pos;
+    blocks_sync_range(extents[i].pos, extents[i].size);
+  }
+  return bufv;
+}
+
+// Read into a buffer of our own. libfuse sends the data after this returns,
+// when the file's blocks may already belong to another file, so unlike the
+// low-level read this copies them while the inode is locked. libfuse frees
+// the buffer vector and the memory in it.
+int nufs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
+                  off_t offset, struct fuse_file_info *fi) {
+  int inum = nufs_file_inum(path, fi);
+  int rv = -ENOENT;
+
+  if (inum >= 0) {
+    nufs_flush_inode(inum, offset, size);
+    struct fuse_bufvec *bufv = malloc(sizeof(struct fuse_bufvec));
+    char *data = malloc(size ? size : 1);
+    rv = bufv && data ? storage_read_inode(inum, data, size, offset) : -ENOMEM;
+    if (rv < 0) {
+      free(bufv);
+      free(data);
+    } else {
+      *bufv = FUSE_BUFVEC_INIT(rv);
+      bufv->buf[0].mem = data;
+      *bufp = bufv;
+      nufs_file_readahead(fi, offset, size);
+    }
+  }
+  printf("read_buf(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
+  return rv < 0 ? rv : 0;
+}
+
+// Write the data of a buffer vector at the given offset. Data libfuse has
+// already read into memory goes in with one vectored write. Otherwise each
+// extent of the file gets one fuse_buf_copy into the image file, which
+// libfuse turns into a splice when the data is still in the /dev/fuse pipe.
+int nufs_write_bufvec(int inum, struct fuse_bufvec *src, off_t offset) {
+  size_t size = fuse_buf_size(src);
+
+  int in_memory = 1;
+  for (size_t i = src->idx; i < src->count; ++i) {
+    in_memory = in_memory && !(src->buf[i].flags & FUSE_BUF_IS_FD);
+  }
+  if (in_memory && src->idx < src->count) {
+    storage_iovec_t segments[src->count - src->idx];
+    off_t end = offset;
+    for (size_t i = src->idx; i < src->count; ++i) {
+      size_t skip = i == src->idx ? src->off : 0;
+      segments[i - src->idx].base = (char *) src->buf[i].mem + skip;
+      segments[i - src->idx].len = src->buf[i].size - skip;
+      segments[i - src->idx].offset = end;
+      end += src->buf[i].size - skip;
+    }
+    return storage_writev_inode(inum, segments, src->count - src->idx);
+  }
+
+  inode_t *node = get_inode(inum);
+  inode_wrlock(inum);
+
+  int old_size = node->size;
+  storage_extent_t extents[size / BLOCK_SIZE + 2];
+  int count = storage_map_write_inode(inum, offset, size, extents);
+  ssize_t written = 0;
+
+  if (count < 0) {
+    inode_unlock(inum);
+    return count;
+  }
+
+  for (int i = 0; i < count; ++i) {
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(extents[i].size);
+    dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    dst.buf[0].fd = blocks_get_fd();
+    dst.buf[0].pos = extents[i].pos;
+
+    blocks_sync_range(extents[i].pos, extents[i].size);
+    ssize_t rv = fuse_buf_copy(&dst, src, 0);
+    blocks_invalidate_range(extents[i].pos, extents[i].size);
+    if (rv < 0) {
+      written = written ? written : rv;
+      break;
+    }
+    written += rv;
+    if (rv < (ssize_t) extents[i].size) {
+      break;
+    }
+  }
+
+  // Give back what a short write did not fill
+  if (written < (ssize_t) size) {
+    off_t end = offset + (written > 0 ? written : 0);
+    shrink_inode(node, end > old_size ? end : old_size);
+  }
+  inode_unlock(inum);
+  return written;
+}
+
+// Write from libfuse's buffers, see nufs_file_write.
+int nufs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+                   struct fuse_file_info *fi) {
+  int inum = nufs_file_inum(path, fi);
+  int rv = inum < 0 ? -ENOENT : nufs_file_write(inum, fi, buf, offset);
+  printf("write_buf(%s, %ld bytes, @+%ld) -> %d\n", path, fuse_buf_size(buf),
+         offset, rv);
+  return rv;
+}
+
 // Actually read data
 int nufs_read(const char *path, char *buf, size_t size, off_t offset,
               struct fuse_file_info *fi) {
-  int rv = -1;
-  rv = storage_read(path, buf, size, offset);
+  int inum = nufs_file_inum(path, fi);
+  nufs_flush_inode(inum, offset, size);
+  int rv = inum < 0 ? -ENOENT : storage_read_inode(inum, buf, size, offset);
+  if (rv >= 0) {
+    nufs_file_readahead(fi, offset, size);
+  }
   printf("read(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
   return rv;
 }
@@ -194,35 +746,194 @@ int nufs_read(const char *path, char *buf, size_t size, off_t offset,
 // Actually write data
 int nufs_write(const char *path, const char *buf, size_t size, off_t offset,
                struct fuse_file_info *fi) {
-  int rv = -1;
-  rv = storage_write(path, buf, size, offset);
+  int inum = nufs_file_inum(path, fi);
+  struct fuse_bufvec src = FUSE_BUFVEC_INIT(size);
+  src.buf[0].mem = (void *) buf;
+  int rv = inum < 0 ? -ENOENT : nufs_file_write(inum, fi, &src, offset);
   printf("write(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
   return rv;
 }
 
 // Update the timestamps on a file or directory.
+#if FUSE_USE_VERSION >= 30
+int nufs_utimens(const char *path, const struct timespec ts[2],
+                 struct fuse_file_info *fi) {
+#else
 int nufs_utimens(const char *path, const struct timespec ts[2]) {
+#endif
   int rv = -1;
   printf("utimens(%s, [%ld, %ld; %ld %ld]) -> %d\n", path, ts[0].tv_sec,
          ts[0].tv_nsec, ts[1].tv_sec, ts[1].tv_nsec, rv);
   return rv;
 }
 
-// Extended operations
+// Connection options shared by both frontends.
+void nufs_init_conn(struct fuse_conn_info *conn) {
+  // Whole-megabyte writes instead of one request per page; reads are
+  // capped by the max_read mount option main adds
+#if FUSE_USE_VERSION < 30
+  if (conn->capable & FUSE_CAP_BIG_WRITES) {
+    conn->want |= FUSE_CAP_BIG_WRITES;
+  }
+#endif
+  conn->max_write = NUFS_IO_MAX;
+
+  // Let the kernel collect writes in its page cache and send them in large
+  // batches; it keeps track of the file size in the meantime
+#if FUSE_USE_VERSION >= 30
+  if (conn->capable & FUSE_CAP_WRITEBACK_CACHE) {
+    conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+  }
+#endif
+
+  // Let libfuse splice the image pages read_buf points at, and splice
+  // written data from /dev/fuse into the image file
+  if (conn->capable & FUSE_CAP_SPLICE_WRITE) {
+    conn->want |= FUSE_CAP_SPLICE_WRITE;
+  }
+  if (conn->capable & FUSE_CAP_SPLICE_READ) {
+    conn->want |= FUSE_CAP_SPLICE_READ;
+  }
+}
+
+#if FUSE_USE_VERSION >= 30
+void *nufs_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
+#else
+void *nufs_init(struct fuse_conn_info *conn) {
+#endif
+  nufs_init_conn(conn);
+  return NULL;
+}
+
+// Unmounting; nothing may stay behind in memory only.
+void nufs_destroy(void *private_data) {
+  nufs_flush_all();
+  blocks_sync();
+}
+
+// Extended operations on the given inode, see nufs_ioctl.h. Shared by both
+// frontends; data holds the argument in and the result out.
+int nufs_ioctl_inode(int inum, unsigned int cmd, void *data) {
+  int rv = -ENOTTY;
+  inode_t *node = get_inode(inum);
+
+  switch (cmd) {
+  case NUFS_IOC_SET_ORDERED:
+    inode_wrlock(inum);
+    rv = S_ISDIR(node->mode) ? directory_set_ordered(node) : -ENOTDIR;
+    inode_unlock(inum);
+    break;
+
+  case NUFS_IOC_LIST_RANGE: {
+    struct nufs_range *range = data;
+    dirent_t entries[NUFS_RANGE_MAX];
+
+    inode_rdlock(inum);
+    rv = directory_range(node, range->after, range->before, range->prefix,
+                         entries, NUFS_RANGE_MAX);
+    inode_unlock(inum);
+    if (rv < 0) {
+      break;
+    }
+
+    range->count = rv;
+    for (int i = 0; i < rv; ++i) {
+      memcpy(range->entries[i].name, entries[i].name, NUFS_NAME_MAX);
+      range->entries[i].inum = entries[i].inum;
+      range->entries[i].type = entries[i].type;
+    }
+    rv = 0;
+    break;
+  }
+
+  case NUFS_IOC_RMTREE: {
+    struct nufs_name *target = data;
+
+    if (!S_ISDIR(node->mode)) {
+      rv = -ENOTDIR;
+      break;
+    }
+    if (strnlen(target->name, NUFS_NAME_MAX) == NUFS_NAME_MAX ||
+        target->name[0] == 0 || strchr(target->name, '/') ||
+        !strcmp(target->name, ".") || !strcmp(target->name, "..")) {
+      rv = -EINVAL;
+      break;
+    }
+
+    rv = storage_rmtree_at(inum, target->name);
+    break;
+  }
+
+  case NUFS_IOC_CREATE_BATCH: {
+    struct nufs_create_batch *batch = data;
+    storage_create_t files[NUFS_BATCH_MAX];
+
+    rv = batch->count <= NUFS_BATCH_MAX ? 0 : -EINVAL;
+    for (uint32_t i = 0; i < batch->count && rv == 0; ++i) {
+      struct nufs_create_entry *entry = &batch->entries[i];
+
+      if (strnlen(entry->name, NUFS_NAME_MAX) == NUFS_NAME_MAX ||
+          entry->offset > NUFS_BATCH_DATA ||
+          entry->size > NUFS_BATCH_DATA - entry->offset) {
+        rv = -EINVAL;
+        break;
+      }
+      files[i].name = entry->name;
+      files[i].mode = entry->mode;
+      files[i].size = entry->size;
+      files[i].data = batch->data + entry->offset;
+    }
+    if (rv < 0) {
+      break;
+    }
+
+    rv = storage_create_batch(inum, files, batch->count);
+    if (rv >= 0) {
+      batch->created = rv;
+      rv = 0;
+    }
+    break;
+  }
+
+  case NUFS_IOC_CACHE_STATS: {
+    struct nufs_cache_stats *out = data;
+    bcache_stats_t stats;
+
+    rv = blocks_cache_stats(&stats);
+    if (rv == 0) {
+      out->hits = stats.hits;
+      out->misses = stats.misses;
+      out->evictions = stats.evictions;
+      out->writebacks = stats.writebacks;
+      out->cached = stats.cached;
+      out->pinned = stats.pinned;
+    }
+    break;
+  }
+  }
+
+  return rv;
+}
+
 int nufs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
                unsigned int flags, void *data) {
-  int rv = -1;
+  int rv = path_lookup(path);
+  rv = rv < 0 ? -ENOENT : nufs_ioctl_inode(rv, cmd, data);
   printf("ioctl(%s, %d, ...) -> %d\n", path, cmd, rv);
   return rv;
 }
 
 void nufs_init_ops(struct fuse_operations *ops) {
   memset(ops, 0, sizeof(struct fuse_operations));
+  ops->init = nufs_init;
+  ops->destroy = nufs_destroy;
   ops->access = nufs_access;
   ops->getattr = nufs_getattr;
+  ops->opendir = nufs_opendir;
   ops->readdir = nufs_readdir;
+  ops->releasedir = nufs_releasedir;
   ops->mknod = nufs_mknod;
-  // ops->create   = nufs_create; // alternative to mknod
+  ops->create = nufs_create;
   ops->mkdir = nufs_mkdir;
   ops->link = nufs_link;
   ops->unlink = nufs_unlink;
@@ -230,18 +941,47 @@ void nufs_init_ops(struct fuse_operations *ops) {
   ops->rename = nufs_rename;
   ops->chmod = nufs_chmod;
   ops->truncate = nufs_truncate;
+#if FUSE_USE_VERSION < 30
+  ops->ftruncate = nufs_ftruncate;
+#endif
   ops->open = nufs_open;
+  ops->release = nufs_release;
+  ops->flush = nufs_flush;
+  ops->fsync = nufs_fsync;
   ops->read = nufs_read;
+  ops->read_buf = nufs_read_buf;
   ops->write = nufs_write;
+  ops->write_buf = nufs_write_buf;
   ops->utimens = nufs_utimens;
   ops->ioctl = nufs_ioctl;
 };
 
 struct fuse_operations nufs_ops;
 
+// Mount options for large requests, see nufs_init_conn
+#define NUFS_STR(x) #x
+#define NUFS_XSTR(x) NUFS_STR(x)
+#if FUSE_USE_VERSION >= 30
+#define NUFS_MOUNT_OPTIONS "-omax_read=" NUFS_XSTR(NUFS_IO_MAX)
+#else
+#define NUFS_MOUNT_OPTIONS                                                     \
+  "-obig_writes,max_read=" NUFS_XSTR(NUFS_IO_MAX) ",max_write=" NUFS_XSTR(NUFS_IO_MAX)
+#endif
+
 int main(int argc, char *argv[]) {
   assert(argc > 2 && argc < 6);
-  storage_init(argv[--argc]);
+  const char *image = argv[--argc];
+  if (storage_init(image) < 0) {
+    fprintf(stderr, "nufs: %s was made by another version of nufs\n", image);
+    return 1;
+  }
+
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  fuse_opt_add_arg(&args, NUFS_MOUNT_OPTIONS);
+#ifdef NUFS_LOWLEVEL
+  return nufs_ll_main(args.argc, args.argv);
+#else
   nufs_init_ops(&nufs_ops);
-  return fuse_main(argc, argv, &nufs_ops, NULL);
+  return fuse_main(args.argc, args.argv, &nufs_ops, NULL);
+#endif
 }
@@ -0,0 +1,56 @@
+// Pieces shared by the two FUSE frontends: the high-level, path-based one in
+// nufs.c and the low-level, inode-based one in nufs_ll.c.
+
+#ifndef NUFS_H
+#define NUFS_H
+
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "storage.h"
+
+// Largest read or write request the kernel is asked to send
+#define NUFS_IO_MAX 1048576 // 1MB
+
+struct fuse_file_info;
+struct fuse_conn_info;
+struct fuse_bufvec;
+
+// Writes to an open file smaller than NUFS_WBUF_SMALL that continue one
+// another are gathered in a buffer of NUFS_WBUF_SIZE bytes, and reach
+// storage as one write of whole blocks once it fills up
+#define NUFS_WBUF_SIZE (64 * 1024)
+#define NUFS_WBUF_SMALL (16 * 1024)
+
+// File handles carry the inode number, so I/O on an open file never
+// resolves its path again.
+typedef struct nufs_file {
+  int inum;
+  storage_readahead_t ra;
+  pthread_mutex_t wb_lock; // over the buffer, see nufs.c
+  char *wb_data;   // write buffer, allocated on first use
+  off_t wb_offset; // file offset of the buffered data
+  size_t wb_size;  // bytes buffered, 0 if none
+  int wb_error;    // failed write-out not reported yet, or 0
+  int wb_users;    // flushes of other requests using the handle
+  int wb_detached; // released, freed by the last of those flushes
+  struct nufs_file *wb_prev, *wb_next; // handles with buffered data
+} nufs_file_t;
+
+int nufs_file_attach(int inum, struct fuse_file_info *fi);
+int nufs_file_detach(struct fuse_file_info *fi);
+void nufs_file_readahead(struct fuse_file_info *fi, off_t offset, size_t size);
+int nufs_file_write(int inum, struct fuse_file_info *fi, struct fuse_bufvec *src,
+                    off_t offset);
+int nufs_file_flush(struct fuse_file_info *fi);
+void nufs_flush_inode(int inum, off_t offset, size_t size);
+void nufs_flush_all();
+int nufs_ioctl_inode(int inum, unsigned int cmd, void *data);
+void nufs_init_conn(struct fuse_conn_info *conn);
+struct fuse_bufvec *nufs_read_bufvec(int inum, size_t size, off_t offset);
+int nufs_write_bufvec(int inum, struct fuse_bufvec *src, off_t offset);
+
+// Runs the low-level frontend (FUSE 3 only)
+int nufs_ll_main(int argc, char *argv[]);
+
+#endif
@@ -0,0 +1,100 @@
+/**
+ * @file nufs_ioctl.h
+ *
+ * ioctl commands understood by nufs, for programs running on a mounted
+ * file system. All of them are issued on an open directory.
+ */
+#ifndef NUFS_IOCTL_H
+#define NUFS_IOCTL_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+#define NUFS_IOC_MAGIC 'N'
+
+// Longest entry name, including the terminating 0 (DIR_NAME_LENGTH)
+#define NUFS_NAME_MAX 48
+
+// Entries returned by one NUFS_IOC_LIST_RANGE call
+#define NUFS_RANGE_MAX 32
+
+// Files created by one NUFS_IOC_CREATE_BATCH call, and room for their contents
+#define NUFS_BATCH_MAX 16
+#define NUFS_BATCH_DATA 8192
+
+struct nufs_range_entry {
+  char name[NUFS_NAME_MAX];
+  uint32_t inum;
+  uint32_t type; // file type, as in d_type
+};
+
+struct nufs_name {
+  char name[NUFS_NAME_MAX];
+};
+
+struct nufs_create_entry {
+  char name[NUFS_NAME_MAX];
+  uint32_t mode;   // a regular file mode
+  uint32_t size;   // file size
+  uint32_t offset; // where the contents start in data
+};
+
+struct nufs_create_batch {
+  uint32_t count;   // in: entries to create
+  uint32_t created; // out: how many of the entries were created, in order
+  struct nufs_create_entry entries[NUFS_BATCH_MAX];
+  char data[NUFS_BATCH_DATA];
+};
+
+struct nufs_cache_stats {
+  uint64_t hits;       // block lookups that found the block cached
+  uint64_t misses;     // block lookups that read the image file
+  uint64_t evictions;  // blocks dropped to make room
+  uint64_t writebacks; // changed blocks written to the image file
+  uint32_t cached;     // blocks that may be evicted, now
+  uint32_t pinned;     // metadata blocks kept in memory, now
+};
+
+struct nufs_range {
+  char after[NUFS_NAME_MAX];  // in: list names greater than this ("" for all)
+  char before[NUFS_NAME_MAX]; // in: list names less than this ("" for all)
+  char prefix[NUFS_NAME_MAX]; // in: list only names with this prefix
+  uint32_t count;             // out: entries returned, < NUFS_RANGE_MAX at the end
+  struct nufs_range_entry entries[NUFS_RANGE_MAX]; // out: in name order
+};
+
+/**
+ * Turn the (empty) directory into an ordered directory. Its entries are kept
+ * in a B+tree sorted by name, readdir lists them in order, and directories
+ * created inside it are ordered as well.
+ */
+#define NUFS_IOC_SET_ORDERED _IO(NUFS_IOC_MAGIC, 1)
+
+/**
+ * List a range of an ordered directory in name order. To get the next
+ * batch, call again with after set to the name of the last entry returned.
+ */
+#define NUFS_IOC_LIST_RANGE _IOWR(NUFS_IOC_MAGIC, 2, struct nufs_range)
+
+/**
+ * Delete the named entry of the directory and, if it is a directory,
+ * everything below it, in one call. Like rm -r, but without a round trip
+ * through the kernel for every file.
+ */
+#define NUFS_IOC_RMTREE _IOW(NUFS_IOC_MAGIC, 3, struct nufs_name)
+
+/**
+ * Create files with their contents in the directory, all in one call, e.g.
+ * when extracting an archive. If created comes back less than count, the
+ * entry at that index could not be created and neither were the ones after
+ * it.
+ */
+#define NUFS_IOC_CREATE_BATCH _IOWR(NUFS_IOC_MAGIC, 4, struct nufs_create_batch)
+
+/**
+ * Get the counters of the block cache, for tuning its size. Fails with
+ * ENOTTY unless nufs was built with -DNUFS_BCACHE.
+ */
+#define NUFS_IOC_CACHE_STATS _IOR(NUFS_IOC_MAGIC, 5, struct nufs_cache_stats)
+
+#endif
@@ -0,0 +1,561 @@
+// Low-level FUSE 3 frontend.
+//
+// Requests name inodes by number instead of by path, so nothing is ever
+// resolved from the root: FUSE inode n is nufs inode n - 1, which makes the
+// root (inode 0) FUSE_ROOT_ID. The kernel's lookup count of each inode is
+// kept with inode_pin/inode_unpin, so a file that is unlinked while the
+// kernel still knows it stays usable until it is forgotten.
+//
+// Built with -DFUSE_USE_VERSION=30 -DNUFS_LOWLEVEL; main in nufs.c runs it.
+
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 26
+#endif
+
+#if FUSE_USE_VERSION >= 30
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <fuse_lowlevel.h>
+
+#include "directory.h"
+#include "inode.h"
+#include "nufs.h"
+#include "nufs_ioctl.h"
+#include "storage.h"
+
+// How long the kernel may cache names, attributes and missing names, in
+// seconds. Everything but the ioctls changes the image through the kernel,
+// and nufs_ll_ioctl invalidates what those change.
+#define NUFS_LL_TIMEOUT 60.0
+
+// The session, for cache invalidations
+static struct fuse_session *nufs_ll_session;
+
+#define INUM(ino) ((int) (ino) - 1)
+#define INO(inum) ((fuse_ino_t) (inum) + 1)
+
+// Fill in the attributes of an inode as the kernel sees them.
+static void nufs_ll_stat(int inum, struct stat *st) {
+  // The size must count writes still sitting in a handle's buffer
+  nufs_flush_inode(inum, 0, SIZE_MAX);
+  memset(st, 0, sizeof(*st));
+  storage_stat_inode(inum, st);
+  st->st_ino = INO(inum);
+  st->st_uid = getuid();
+}
+
+// Fill in a directory entry for the kernel. Replying with it counts as a
+// lookup, which the caller pins.
+static void nufs_ll_entry(int inum, struct fuse_entry_param *e) {
+  memset(e, 0, sizeof(*e));
+  e->ino = INO(inum);
+  e->attr_timeout = NUFS_LL_TIMEOUT;
+  e->entry_timeout = NUFS_LL_TIMEOUT;
+  nufs_ll_stat(inum, &e->attr);
+}
+
+// Reply with an entry for a new or newly found inode. The caller pinned it
+// while the directory naming it was still locked, so that it cannot be
+// unlinked and freed in between.
+static void nufs_ll_reply_entry(fuse_req_t req, int inum) {
+  struct fuse_entry_param e;
+  nufs_ll_entry(inum, &e);
+  fuse_reply_entry(req, &e);
+}
+
+// Reply with just a status, rv being 0 or a negative errno.
+static void nufs_ll_reply(fuse_req_t req, int rv) {
+  fuse_reply_err(req, rv < 0 ? -rv : 0);
+}
+
+static void nufs_ll_init(void *userdata, struct fuse_conn_info *conn) {
+  nufs_init_conn(conn);
+}
+
+static void nufs_ll_destroy(void *userdata) {
+  // The kernel is gone; free what was only kept for it
+  nufs_flush_all();
+  inode_unpin_all();
+  blocks_sync();
+}
+
+static void nufs_ll_lookup(fuse_req_t req, fuse_ino_t parent,
+                           const char *name) {
+  inode_t *dir = get_inode(INUM(parent));
+  inode_rdlock(INUM(parent));
+  int rv = S_ISDIR(dir->mode) ? directory_lookup(dir, name) : -ENOTDIR;
+  if (rv >= 0) {
+    inode_pin(rv, 1);
+  }
+  inode_unlock(INUM(parent));
+
+  if (rv >= 0) {
+    nufs_ll_reply_entry(req, rv);
+  } else if (rv == -ENOTDIR) {
+    nufs_ll_reply(req, rv);
+  } else {
+    // Let the kernel remember that the name is missing
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+    e.entry_timeout = NUFS_LL_TIMEOUT;
+    fuse_reply_entry(req, &e);
+  }
+  printf("lookup(%lu, %s) -> %d\n", parent, name, rv);
+}
+
+static void nufs_ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+  inode_unpin(INUM(ino), nlookup);
+  fuse_reply_none(req);
+}
+
+static void nufs_ll_forget_multi(fuse_req_t req, size_t count,
+                                 struct fuse_forget_data *forgets) {
+  for (size_t i = 0; i < count; ++i) {
+    inode_unpin(INUM(forgets[i].ino), forgets[i].nlookup);
+  }
+  fuse_reply_none(req);
+}
+
+static void nufs_ll_getattr(fuse_req_t req, fuse_ino_t ino,
+                            struct fuse_file_info *fi) {
+  struct stat st;
+  nufs_ll_stat(INUM(ino), &st);
+  fuse_reply_attr(req, &st, NUFS_LL_TIMEOUT);
+}
+
+// chmod and truncate; owners and times are not stored.
+static void nufs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                            int to_set, struct fuse_file_info *fi) {
+  int inum = INUM(ino);
+  int rv = 0;
+
+  if (to_set & FUSE_SET_ATTR_MODE) {
+    inode_t *node = get_inode(inum);
+    inode_wrlock(inum);
+    node->mode = (node->mode & ~07777) | (attr->st_mode & 07777);
+    inode_unlock(inum);
+  }
+  if (to_set & FUSE_SET_ATTR_SIZE) {
+    nufs_flush_inode(inum, 0, SIZE_MAX);
+    rv = storage_truncate_inode(inum, attr->st_size);
+  }
+
+  if (rv < 0) {
+    nufs_ll_reply(req, rv);
+  } else {
+    struct stat st;
+    nufs_ll_stat(inum, &st);
+    fuse_reply_attr(req, &st, NUFS_LL_TIMEOUT);
+  }
+  printf("setattr(%lu, %#x) -> %d\n", ino, to_set, rv);
+}
+
+// mknod, mkdir and create; create also opens the new file.
+static void nufs_ll_make(fuse_req_t req, fuse_ino_t parent, const char *name,
+                         mode_t mode, struct fuse_file_info *fi) {
+  int rv = storage_create_at(INUM(parent), name, mode, 1);
+
+  if (rv >= 0 && fi) {
+    int inum = rv;
+    struct fuse_entry_param e;
+
+    rv = nufs_file_attach(inum, fi);
+    if (rv == 0) {
+      nufs_ll_entry(inum, &e);
+      fuse_reply_create(req, &e, fi);
+    } else {
+      inode_unpin(inum, 1); // The kernel never learns of it
+    }
+  } else if (rv >= 0) {
+    nufs_ll_reply_entry(req, rv);
+  }
+
+  if (rv < 0) {
+    nufs_ll_reply(req, rv);
+  }
+  printf("create(%lu, %s, %04o) -> %d\n", parent, name, mode, rv);
+}
+
+static void nufs_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+                          mode_t mode, dev_t rdev) {
+  nufs_ll_make(req, parent, name, mode, NULL);
+}
+
+static void nufs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+                          mode_t mode) {
+  nufs_ll_make(req, parent, name, mode | S_IFDIR, NULL);
+}
+
+static void nufs_ll_create(fuse_req_t req, fuse_ino_t parent,
+                           const char *name, mode_t mode,
+                           struct fuse_file_info *fi) {
+  nufs_ll_make(req, parent, name, mode, fi);
+}
+
+static void nufs_ll_unlink(fuse_req_t req, fuse_ino_t parent,
+                           const char *name) {
+  int rv = storage_unlink_at(INUM(parent), name);
+  nufs_ll_reply(req, rv);
+  printf("unlink(%lu, %s) -> %d\n", parent, name, rv);
+}
+
+static void nufs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  int rv = storage_rmdir_at(INUM(parent), name);
+  nufs_ll_reply(req, rv);
+  printf("rmdir(%lu, %s) -> %d\n", parent, name, rv);
+}
+
+static void nufs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                           fuse_ino_t newparent, const char *newname,
+                           unsigned int flags) {
+  int rv = storage_rename_at(INUM(parent), name, INUM(newparent), newname,
+                             flags);
+  nufs_ll_reply(req, rv);
+  printf("rename(%lu, %s => %lu, %s) -> %d\n", parent, name, newparent,
+         newname, rv);
+}
+
+static void nufs_ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+                         const char *newname) {
+  int rv = storage_link_at(INUM(ino), INUM(newparent), newname, 1);
+
+  if (rv < 0) {
+    nufs_ll_reply(req, rv);
+  } else {
+    nufs_ll_reply_entry(req, INUM(ino));
+  }
+  printf("link(%lu => %lu, %s) -> %d\n", ino, newparent, newname, rv);
+}
+
+static void nufs_ll_open(fuse_req_t req, fuse_ino_t ino,
+                         struct fuse_file_info *fi) {
+  int rv = nufs_file_attach(INUM(ino), fi);
+
+  if (rv < 0) {
+    nufs_ll_reply(req, rv);
+  } else {
+    fuse_reply_open(req, fi);
+  }
+  printf("open(%lu) -> %d\n", ino, rv);
+}
+
+static void nufs_ll_release(fuse_req_t req, fuse_ino_t ino,
+                            struct fuse_file_info *fi) {
+  nufs_ll_reply(req, nufs_file_detach(fi));
+}
+
+// Reply with buffers in the image file, see nufs_read_bufvec.
+static void nufs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+                         off_t off, struct fuse_file_info *fi) {
+  nufs_flush_inode(INUM(ino), off, size);
+  nufs_file_readahead(fi, off, size);
+
+  // Held until the data is sent, so the blocks stay the file's
+  inode_rdlock(INUM(ino));
+  struct fuse_bufvec *bufv = nufs_read_bufvec(INUM(ino), size, off);
+  int rv = bufv ? (int) fuse_buf_size(bufv) : -ENOMEM;
+
+  if (rv < 0) {
+    nufs_ll_reply(req, rv);
+  } else {
+    fuse_reply_data(req, bufv, 0);
+  }
+  inode_unlock(INUM(ino));
+  free(bufv);
+  printf("read(%lu, %ld bytes, @+%ld) -> %d\n", ino, size, off, rv);
+}
+
+static void nufs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+                          size_t size, off_t off, struct fuse_file_info *fi) {
+  struct fuse_bufvec src = FUSE_BUFVEC_INIT(size);
+  src.buf[0].mem = (void *) buf;
+  int rv = nufs_file_write(INUM(ino), fi, &src, off);
+
+  if (rv < 0) {
+    nufs_ll_reply(req, rv);
+  } else {
+    fuse_reply_write(req, rv);
+  }
+  printf("write(%lu, %ld bytes, @+%ld) -> %d\n", ino, size, off, rv);
+}
+
+// Write from libfuse's buffers, see nufs_file_write.
+static void nufs_ll_write_buf(fuse_req_t req, fuse_ino_t ino,
+                              struct fuse_bufvec *bufv, off_t off,
+                              struct fuse_file_info *fi) {
+  size_t size = fuse_buf_size(bufv);
+  int rv = nufs_file_write(INUM(ino), fi, bufv, off);
+
+  if (rv < 0) {
+    nufs_ll_reply(req, rv);
+  } else {
+    fuse_reply_write(req, rv);
+  }
+  printf("write_buf(%lu, %ld bytes, @+%ld) -> %d\n", ino, size, off, rv);
+}
+
+// Called on every close of the file, see nufs_flush.
+static void nufs_ll_flush(fuse_req_t req, fuse_ino_t ino,
+                          struct fuse_file_info *fi) {
+  nufs_ll_reply(req, nufs_file_flush(fi));
+}
+
+static void nufs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                          struct fuse_file_info *fi) {
+  int rv = nufs_file_flush(fi);
+  int synced = blocks_fsync(datasync);
+  rv = rv < 0 ? rv : synced;
+  nufs_ll_reply(req, rv);
+  printf("fsync(%lu) -> %d\n", ino, rv);
+}
+
+// Directory handles carry the readdir cursor, as in the high-level frontend.
+static void nufs_ll_opendir(fuse_req_t req, fuse_ino_t ino,
+                            struct fuse_file_info *fi) {
+  dir_cursor_t *cur = calloc(1, sizeof(dir_cursor_t));
+
+  if (cur == NULL) {
+    nufs_ll_reply(req, -ENOMEM);
+    return;
+  }
+  fi->fh = (uintptr_t) cur;
+  fuse_reply_open(req, fi);
+}
+
+static void nufs_ll_releasedir(fuse_req_t req, fuse_ino_t ino,
+                               struct fuse_file_info *fi) {
+  free((dir_cursor_t *) (uintptr_t) fi->fh);
+  nufs_ll_reply(req, 0);
+}
+
+// A directory listing being put together for the kernel
+typedef struct nufs_ll_listing {
+  fuse_req_t req;
+  char *buf;
+  size_t size;
+  size_t used;
+  int plus;
+} nufs_ll_listing_t;
+
+// Add an entry to a listing. A plain listing only reports the type stored in
+// the entry, so no inode is loaded; readdirplus sends full attributes.
+// Returns 0 if the entry does not fit.
+static int nufs_ll_add(nufs_ll_listing_t *list, const char *name, int inum,
+                       int type, off_t next) {
+  struct fuse_entry_param e;
+  char *buf = list->buf + list->used;
+  size_t room = list->size - list->used;
+  size_t len;
+
+  if (list->plus || type == 0) {
+    nufs_ll_entry(inum, &e);
+  } else {
+    memset(&e, 0, sizeof(e));
+    e.attr.st_ino = INO(inum);
+    e.attr.st_mode = DIRENT_MODE(type);
+  }
+
+  len = list->plus
+            ? fuse_add_direntry_plus(list->req, buf, room, name, &e, next)
+            : fuse_add_direntry(list->req, buf, room, name, &e.attr, next);
+  if (len > room) {
+    return 0;
+  }
+  list->used += len;
+  return 1;
+}
+
+// readdir and readdirplus. Offsets are as in nufs_readdir: 1 and 2 for '.'
+// and '..', then the cursor slot + 2. Every entry but '.' and '..' that
+// readdirplus returns counts as a lookup of its inode.
+static void nufs_ll_list(fuse_req_t req, fuse_ino_t ino, size_t size,
+                         off_t off, struct fuse_file_info *fi, int plus) {
+  int inum = INUM(ino);
+  inode_t *dir = get_inode(inum);
+  nufs_ll_listing_t list = { req, malloc(size), size, 0, plus };
+  int dt_dir = DIRENT_TYPE(S_IFDIR);
+
+  if (list.buf == NULL) {
+    nufs_ll_reply(req, -ENOMEM);
+    return;
+  }
+
+  inode_rdlock(inum);
+  int parent = dir->parent;
+  inode_unlock(inum);
+
+  if ((off >= 1 || nufs_ll_add(&list, ".", inum, dt_dir, 1)) &&
+      (off >= 2 || nufs_ll_add(&list, "..", parent, dt_dir, 2))) {
+    dir_cursor_t *cur = (dir_cursor_t *) (uintptr_t) fi->fh;
+    inode_rdlock(inum);
+    directory_seek(dir, cur, off < 2 ? 0 : off - 2);
+
+    dir_cursor_t prev = *cur;
+    dirent_t *entry;
+    while ((entry = directory_next(dir, cur)) != NULL) {
+      if (!nufs_ll_add(&list, entry->name, entry->inum, entry->type,
+                       cur->slot + 2)) {
+        // The kernel comes back for this entry
+        *cur = prev;
+        break;
+      }
+      if (plus) {
+        inode_pin(entry->inum, 1);
+      }
+      prev = *cur;
+    }
+    inode_unlock(inum);
+  }
+
+  fuse_reply_buf(req, list.buf, list.used);
+  free(list.buf);
+  printf("readdir%s(%lu, @%ld) -> %ld bytes\n", plus ? "plus" : "", ino, off,
+         list.used);
+}
+
+static void nufs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                            off_t off, struct fuse_file_info *fi) {
+  nufs_ll_list(req, ino, size, off, fi, 0);
+}
+
+static void nufs_ll_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size,
+                                off_t off, struct fuse_file_info *fi) {
+  nufs_ll_list(req, ino, size, off, fi, 1);
+}
+
+// Drop the kernel's cached names and attributes that an ioctl changed.
+static void nufs_ll_ioctl_invalidate(fuse_ino_t ino, unsigned int cmd,
+                                     void *data) {
+  struct fuse_session *se = nufs_ll_session;
+
+  switch (cmd) {
+  case NUFS_IOC_RMTREE: {
+    struct nufs_name *target = data;
+    fuse_lowlevel_notify_inval_entry(se, ino, target->name,
+                                     strlen(target->name));
+    break;
+  }
+
+  case NUFS_IOC_CREATE_BATCH: {
+    struct nufs_create_batch *batch = data;
+    for (uint32_t i = 0; i < batch->created; ++i) {
+      fuse_lowlevel_notify_inval_entry(se, ino, batch->entries[i].name,
+                                       strlen(batch->entries[i].name));
+    }
+    break;
+  }
+
+  default:
+    return;
+  }
+
+  // The directory's own attributes changed too
+  fuse_lowlevel_notify_inval_inode(se, ino, 0, 0);
+}
+
+// The ioctls in nufs_ioctl.h are all restricted ones: the kernel passes in
+// and takes back the _IOC_SIZE bytes their numbers declare.
+static void nufs_ll_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg,
+                          struct fuse_file_info *fi, unsigned flags,
+                          const void *in_buf, size_t in_bufsz,
+                          size_t out_bufsz) {
+  size_t size = _IOC_SIZE((unsigned int) cmd);
+  char *data = calloc(1, size ? size : 1);
+  int rv = data ? 0 : -ENOMEM;
+
+  if (rv == 0) {
+    memcpy(data, in_buf, in_bufsz < size ? in_bufsz : size);
+    rv = nufs_ioctl_inode(INUM(ino), cmd, data);
+  }
+
+  if (rv < 0) {
+    nufs_ll_reply(req, rv);
+  } else {
+    // Before replying, so the caller never sees the old names
+    nufs_ll_ioctl_invalidate(ino, cmd, data);
+    fuse_reply_ioctl(req, rv, out_bufsz ? data : NULL,
+                     out_bufsz < size ? out_bufsz : size);
+  }
+  free(data);
+  printf("ioctl(%lu, %d, ...) -> %d\n", ino, cmd, rv);
+}
+
+static const struct fuse_lowlevel_ops nufs_ll_ops = {
+  .init = nufs_ll_init,
+  .destroy = nufs_ll_destroy,
+  .lookup = nufs_ll_lookup,
+  .forget = nufs_ll_forget,
+  .forget_multi = nufs_ll_forget_multi,
+  .getattr = nufs_ll_getattr,
+  .setattr = nufs_ll_setattr,
+  .mknod = nufs_ll_mknod,
+  .mkdir = nufs_ll_mkdir,
+  .create = nufs_ll_create,
+  .unlink = nufs_ll_unlink,
+  .rmdir = nufs_ll_rmdir,
+  .rename = nufs_ll_rename,
+  .link = nufs_ll_link,
+  .open = nufs_ll_open,
+  .release = nufs_ll_release,
+  .read = nufs_ll_read,
+  .write = nufs_ll_write,
+  .write_buf = nufs_ll_write_buf,
+  .flush = nufs_ll_flush,
+  .fsync = nufs_ll_fsync,
+  .opendir = nufs_ll_opendir,
+  .readdir = nufs_ll_readdir,
+  .readdirplus = nufs_ll_readdirplus,
+  .releasedir = nufs_ll_releasedir,
+  .ioctl = nufs_ll_ioctl,
+};
+
+// Mount and serve requests until unmounted. The image is already open.
+int nufs_ll_main(int argc, char *argv[]) {
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  struct fuse_cmdline_opts opts;
+  struct fuse_session *se;
+  int rv = 1;
+
+  if (fuse_parse_cmdline(&args, &opts) != 0) {
+    return 1;
+  }
+  if (opts.mountpoint == NULL) {
+    fprintf(stderr, "usage: %s [options] <mountpoint> <image>\n", argv[0]);
+    fuse_opt_free_args(&args);
+    return 1;
+  }
+
+  se = fuse_session_new(&args, &nufs_ll_ops, sizeof(nufs_ll_ops), NULL);
+  nufs_ll_session = se;
+  if (se != NULL) {
+    if (fuse_set_signal_handlers(se) == 0) {
+      if (fuse_session_mount(se, opts.mountpoint) == 0) {
+        fuse_daemonize(opts.foreground);
+        // Requests are served by several threads unless mounted with -s;
+        // see inode.h for the locks that keep them apart
+        if (opts.singlethread) {
+          rv = fuse_session_loop(se) ? 1 : 0;
+        } else {
+          rv = fuse_session_loop_mt(se, opts.clone_fd) ? 1 : 0;
+        }
+        fuse_session_unmount(se);
+      }
+      fuse_remove_signal_handlers(se);
+    }
+    fuse_session_destroy(se);
+  }
+
+  free(opts.mountpoint);
+  fuse_opt_free_args(&args);
+  return rv;
+}
+
+#endif
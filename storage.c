@@ -5,6 +5,8 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <pthread.h>
+#include <assert.h>
 #include "slist.h"
 #include "directory.h"
 #include "storage.h"
@@ -13,17 +15,52 @@
 
 // Helper function declaration (Shall be described further later)
 static void split_path(const char *fullPath, char *parentPath, char *childName);
+static int storage_is_ancestor(int ancestor, int inum);
+static void storage_fill(inode_t *node, const char *data, size_t size);
+static int storage_parent(const char *path, char *name);
+static int storage_run(const storage_iovec_t *iov, int first, int count, size_t *length);
+static int storage_append(inode_t *inode, const char *buf, size_t size);
+static size_t storage_copy_run(const storage_iovec_t *iov, const storage_extent_t *extents,
+                               int count, int write);
+static int storage_lock_entry(inode_t *dir, const char *name);
+static int storage_lock_before(int a, int b);
+static int storage_create_locked(int dir, const char *name, int mode);
+static int storage_create_batch_locked(int dir, const storage_create_t *files, int count);
+static int storage_rename_locked(int fromDir, const char *from, int toDir, const char *to,
+                                 unsigned int flags);
+
+// Held across moves between directories, so that no two of them can make
+// a directory its own ancestor; see inode.h for the order of the locks
+static pthread_mutex_t storage_rename_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// What the image's format is, at the start of block 3, which the inode
+// table never reaches. STORAGE_VERSION changes whenever the layout of
+// inodes or directory blocks does; images made before there was a version
+// have zeros here, and are refused like those of any other version.
+#define STORAGE_MAGIC 0x5346554e // "NUFS"
+#define STORAGE_VERSION 1
+
+typedef struct storage_super {
+    uint32_t magic;
+    uint32_t version;
+} storage_super_t;
 
 /**
  * Initializes the storage system.
  *
  * @param path Path to the storage location.
- *
+ * @return 0 on success, or -1 if the image has a format this version of
+ *         nufs cannot read.
  */
-void storage_init(const char *path) {
+int storage_init(const char *path) {
 
     // Initialize the block at the given path
     blocks_init(path);
+    inode_init();
+
+    storage_super_t *super = blocks_get_block(3);
+    assert(BLOCK_BITMAP_SIZE * 2 + BLOCK_COUNT * sizeof(inode_t) <=
+           3 * (size_t) BLOCK_SIZE);
 
     // Ensure that necessary blocks are allocated
     if (bitmap_get(get_blocks_bitmap(), 1) == 0) {
@@ -34,6 +71,11 @@ void storage_init(const char *path) {
             // Allocate a block if not already done
             alloc_block();
         }
+        super->magic = STORAGE_MAGIC;
+        super->version = STORAGE_VERSION;
+    }
+    else if (super->magic != STORAGE_MAGIC || super->version != STORAGE_VERSION) {
+        return -1;
     }
 
     // Initialize the root directory if its not already present
@@ -41,6 +83,7 @@ void storage_init(const char *path) {
         directory_init();
     }
 
+    return 0;
 }
 
 
@@ -62,9 +105,34 @@ int storage_stat(const char *path, struct stat *st) {
         return -1;
     }
 
+    return storage_stat_inode(inodeNumber, st);
+}
+
+/**
+ * Retrieves the metadata for the file with the given inode number.
+ *
+ * This is what storage_stat does once the path is resolved, so callers that
+ * already hold an inode number (e.g. from a directory entry) skip the lookup.
+ *
+ * @param inum Inode number of the file.
+ * @param st Pointer to the stat structure to fill with file metadata.
+ * @return 0 on success, or -1 if the inode has been freed meanwhile.
+ */
+int storage_stat_inode(int inum, struct stat *st) {
+
     // Get the inode 
-    inode_t *inode = get_inode(inodeNumber);
-    
+    inode_t *inode = get_inode(inum);
+    inode_rdlock(inum);
+
+    // Freed after the caller found its number
+    if (inode->mode == 0) {
+        inode_unlock(inum);
+        return -1;
+    }
+
+    // Set inode number
+    st->st_ino = inum;
+
     // Set link count
     st->st_nlink = inode->refs;
 
@@ -74,6 +142,7 @@ int storage_stat(const char *path, struct stat *st) {
     // Set file size
     st->st_size = inode->size;
 
+    inode_unlock(inum);
     return 0;
 }
 
@@ -96,19 +165,36 @@ int storage_truncate(const char *path, off_t size) {
         return -1;
     }
 
+    return storage_truncate_inode(inodeNumber, size);
+}
+
+/**
+ * Truncates the file with the given inode number to a specified size.
+ *
+ * @param inum Inode number of the file.
+ * @param size New size of the file.
+ * @return 0 on success, -ENOSPC if the file cannot grow, or -ENOENT if it has
+ *         been freed meanwhile.
+ */
+int storage_truncate_inode(int inum, off_t size) {
+
     // Get inode
-    inode_t *inode = get_inode(inodeNumber);
+    inode_t *inode = get_inode(inum);
+    int rv = 0;
 
-    if (size > inode->size) {
+    inode_wrlock(inum);
+    if (inode->mode == 0) {
+        rv = -ENOENT;
+    } else if (size > inode->size) {
         // Expand the file
-        grow_inode(inode, size);
-    }
-    else {
+        rv = grow_inode(inode, size);
+    } else {
         // Shrink file
         shrink_inode(inode, size);
     }
+    inode_unlock(inum);
 
-    return 0;
+    return rv;
 }
 
 /**
@@ -131,36 +217,359 @@ int storage_read(const char *path, char *buf, size_t size, off_t offset) {
         return -1;
     }
 
-    // Get inode
-    inode_t *inode = get_inode(inodeNumber);
+    return storage_read_inode(inodeNumber, buf, size, offset);
+}
+
+/**
+ * Reads data from the file with the given inode number.
+ *
+ * @param inum Inode number of the file.
+ * @param buf Buffer to store the read data.
+ * @param size Number of bytes to read.
+ * @param offset Offset in the file to start reading from.
+ * @return The number of bytes read, 0 at or past the end of the file.
+ */
+int storage_read_inode(int inum, char *buf, size_t size, off_t offset) {
+
+    storage_iovec_t segment = { buf, size, offset };
+    return storage_readv_inode(inum, &segment, 1);
+}
+
+/**
+ * Reads data from a file into several buffers, each from its own offset.
+ *
+ * @param path Path to the file.
+ * @param iov The segments to read.
+ * @param count The number of segments.
+ * @return The total number of bytes read, or -1 if the file is not found.
+ */
+int storage_readv(const char *path, const storage_iovec_t *iov, int count) {
+
+    int inodeNumber = path_lookup(path);
+
+    if (inodeNumber <= 0) {
+        return -1;
+    }
+
+    return storage_readv_inode(inodeNumber, iov, count);
+}
+
+/**
+ * Reads data from the file with the given inode number into several buffers,
+ * each from its own offset.
+ *
+ * Segments that follow each other in the file are mapped as one range, and
+ * each extent of it is copied out in as few pieces as the buffers allow.
+ * A segment reaching past the end of the file is read up to the end only.
+ *
+ * @param inum Inode number of the file.
+ * @param iov The segments to read.
+ * @param count The number of segments.
+ * @return The total number of bytes read.
+ */
+int storage_readv_inode(int inum, const storage_iovec_t *iov, int count) {
+
+    size_t bytesRead = 0;
+
+    inode_rdlock(inum);
+    for (int first = 0; first < count;) {
+        size_t length;
+        int last = storage_run(iov, first, count, &length);
+
+        storage_extent_t extents[length / BLOCK_SIZE + 2];
+        int mapped = storage_map_inode(inum, iov[first].offset, length, extents);
+
+        bytesRead += storage_copy_run(iov + first, extents, mapped, 0);
+        first = last;
+    }
+    inode_unlock(inum);
+
+    return bytesRead; // Total bytes read
+}
+
+/**
+ * Appends data to a file: the fast path of storage_writev_inode for writers
+ * that only ever add to the end. The file grows with inode_append, once for
+ * the whole write, and the data is copied block by block, the first piece
+ * into what is left of the tail block. Nothing is mapped or zeroed first.
+ *
+ * @param inode The inode of the file.
+ * @param buf The data to append.
+ * @param size The number of bytes to append.
+ * @return The number of bytes written, or -ENOSPC if the file cannot grow.
+ */
+static int storage_append(inode_t *inode, const char *buf, size_t size)
+{
+    off_t offset = inode->size;
+
+    if (inode_append(inode, offset + size) < 0)
+    {
+        return -ENOSPC;
+    }
+
+    for (size_t done = 0; done < size;)
+    {
+        off_t position = offset + done;
+        int blockOffset = position % BLOCK_SIZE;
+
+        size_t chunk = size - done;
+        if (chunk > BLOCK_SIZE - blockOffset)
+        {
+            chunk = BLOCK_SIZE - blockOffset;
+        }
+
+        blocks_write((off_t) inode_get_bnum(inode, position) * BLOCK_SIZE + blockOffset,
+                     buf + done, chunk);
+
+        // What follows the new end in a new block is past the end of the
+        // file, and growing the file zeroes that before it is ever read
+        if (blockOffset == 0)
+        {
+            inode_set_written(inode, position);
+        }
+
+        done += chunk;
+    }
+
+    return size;
+}
+
+/**
+ * Finds the run of segments starting at first in which each segment starts
+ * where the one before it ends in the file.
+ *
+ * @param iov The segments.
+ * @param first The first segment of the run.
+ * @param count The number of segments.
+ * @param length Set to the length of the run in bytes.
+ * @return The index of the first segment after the run.
+ */
+static int storage_run(const storage_iovec_t *iov, int first, int count, size_t *length)
+{
+    int last = first + 1;
+    *length = iov[first].len;
+
+    while (last < count && iov[last].offset == iov[first].offset + (off_t) *length)
+    {
+        *length += iov[last].len;
+        ++last;
+    }
+
+    return last;
+}
+
+/**
+ * Copies between a run of segments and the extents the run maps to.
+ *
+ * @param iov The segments of the run.
+ * @param extents The extents, covering the run or the start of it.
+ * @param count The number of extents.
+ * @param write Nonzero to copy into the extents, zero to copy out of them.
+ * @return The number of bytes copied.
+ */
+static size_t storage_copy_run(const storage_iovec_t *iov, const storage_extent_t *extents,
+                               int count, int write)
+{
+    size_t copied = 0;
+    int segment = 0;
+    size_t segmentDone = 0;
+
+    for (int i = 0; i < count; ++i)
+    {
+        for (size_t done = 0; done < extents[i].size;)
+        {
+            // Move on to the next segment with room left
+            while (segmentDone == iov[segment].len)
+            {
+                ++segment;
+                segmentDone = 0;
+            }
+
+            size_t chunk = extents[i].size - done;
+            if (chunk > iov[segment].len - segmentDone)
+            {
+                chunk = iov[segment].len - segmentDone;
+            }
+
+            char *buf = (char *) iov[segment].base + segmentDone;
+            if (write)
+            {
+                blocks_write(extents[i].pos + done, buf, chunk);
+            }
+            else if (extents[i].unwritten)
+            {
+                memset(buf, 0, chunk);
+            }
+            else
+            {
+                blocks_read(extents[i].pos + done, buf, chunk);
+            }
+
+            done += chunk;
+            segmentDone += chunk;
+            copied += chunk;
+        }
+    }
+
+    return copied;
+}
+
+/**
+ * Finds where a range of a file lies in the disk image, so that it can be
+ * read from the image file without going through a buffer.
+ *
+ * The range is cut off at the end of the file. Blocks that follow each other
+ * on disk are merged into one extent, except for blocks that were never
+ * written, which get an extent each, marked unwritten.
+ *
+ * The caller holds the inode's lock for as long as it uses the extents.
+ *
+ * @param inum Inode number of the file.
+ * @param offset Offset in the file the range starts at.
+ * @param size Length of the range.
+ * @param extents Room for size / BLOCK_SIZE + 2 extents.
+ * @return The number of extents filled in, 0 at or past the end of the file.
+ */
+int storage_map_inode(int inum, off_t offset, size_t size, storage_extent_t *extents) {
+
+    inode_t *inode = get_inode(inum);
 
     if (offset >= inode->size) {
-        return 0; // Offset beyond file size
+        return 0;
+    }
+    if (size > inode->size - offset) {
+        size = inode->size - offset;
     }
 
-    int remainingSize = size;
-    int bytesRead = 0;
+    int count = 0;
+    size_t mapped = 0;
 
-    while (remainingSize > 0) {
+    while (mapped < size) {
+        off_t position = offset + mapped;
+        int blockOffset = position % BLOCK_SIZE;
+        off_t pos = (off_t) inode_get_bnum(inode, position) * BLOCK_SIZE + blockOffset;
 
-    // Block Bitmap number
-    int blockNum = inode_get_bnum(inode, offset + bytesRead);
+        size_t chunk = size - mapped;
+        if (chunk > BLOCK_SIZE - blockOffset) {
+            chunk = BLOCK_SIZE - blockOffset;
+        }
 
-    // Block Pointer
-    char *blockPtr = blocks_get_block(blockNum) + offset % BLOCK_SIZE;
+        int unwritten = inode_is_unwritten(inode, position);
+
+        // Extend the previous extent if this block follows it on disk
+        if (count > 0 && !unwritten && !extents[count - 1].unwritten &&
+            extents[count - 1].pos + extents[count - 1].size == pos) {
+            extents[count - 1].size += chunk;
+        } else {
+            extents[count].pos = pos;
+            extents[count].size = chunk;
+            extents[count].unwritten = unwritten;
+            ++count;
+        }
+        mapped += chunk;
+    }
 
-    // Offset Pointer
-    int blockReadSize = BLOCK_SIZE - offset % BLOCK_SIZE;
+    return count;
+}
 
-    int readSize = (remainingSize < blockReadSize) ? remainingSize : blockReadSize;
+/**
+ * Reads ahead of an open file after a read, if it is being read in order.
+ *
+ * A read that starts where the previous one ended doubles the window, from
+ * STORAGE_READAHEAD_MIN up to STORAGE_READAHEAD_MAX; any other read drops it
+ * to nothing. Once the reader gets within half a window of the data already
+ * prefetched, the extents of the next window are prefetched from the image.
+ *
+ * @param inum Inode number of the file.
+ * @param ra The readahead state of the open file.
+ * @param offset Offset the read started at.
+ * @param size Length of the read.
+ */
+void storage_readahead(int inum, storage_readahead_t *ra, off_t offset, size_t size) {
 
-    memcpy(buf + bytesRead, blockPtr, readSize);
+    off_t end = offset + size;
 
-    remainingSize -= readSize;
-    bytesRead += readSize;
+    if (offset != ra->next) {
+        // Random access, stop reading ahead
+        ra->next = end;
+        ra->ahead = end;
+        ra->window = 0;
+        return;
     }
+    ra->next = end;
 
-    return bytesRead; // Total bytes read
+    if (ra->window == 0) {
+        ra->window = STORAGE_READAHEAD_MIN;
+    } else if (ra->window < STORAGE_READAHEAD_MAX) {
+        ra->window *= 2;
+    }
+
+    // Still far enough ahead of the reader
+    if (ra->ahead > end && ra->ahead - end > (off_t) ra->window / 2) {
+        return;
+    }
+
+    off_t from = ra->ahead > end ? ra->ahead : end;
+    size_t length = end + ra->window - from;
+    storage_extent_t extents[length / BLOCK_SIZE + 2];
+    inode_rdlock(inum);
+    int count = storage_map_inode(inum, from, length, extents);
+    inode_unlock(inum);
+
+    for (int i = 0; i < count; ++i) {
+        if (!extents[i].unwritten) {
+            blocks_prefetch(extents[i].pos, extents[i].size);
+        }
+    }
+    ra->ahead = end + ra->window;
+}
+
+/**
+ * Grows a file to cover a range that is about to be written, then finds where
+ * the range lies in the disk image, as storage_map_inode does. The caller
+ * writes the data into the image file itself.
+ *
+ * Blocks of the range that were never written are marked written, after
+ * zeroing whatever part of them the write does not cover.
+ *
+ * The caller holds the inode's write lock until it has written the data.
+ *
+ * @param inum Inode number of the file.
+ * @param offset Offset in the file the write starts at.
+ * @param size Length of the write.
+ * @param extents Room for size / BLOCK_SIZE + 2 extents.
+ * @return The number of extents filled in, -ENOSPC if the file cannot grow, or
+ *         -ENOENT if it has been freed meanwhile.
+ */
+int storage_map_write_inode(int inum, off_t offset, size_t size, storage_extent_t *extents) {
+
+    inode_t *inode = get_inode(inum);
+    if (inode->mode == 0) {
+        return -ENOENT;
+    }
+
+    off_t endOffset = offset + size;
+    if (endOffset > inode->size && inode_extend(inode, endOffset) < 0) {
+        return -ENOSPC;
+    }
+
+    int count = storage_map_inode(inum, offset, size, extents);
+
+    for (int i = 0; i < count; ++i) {
+        if (extents[i].unwritten) {
+            off_t start = extents[i].pos - extents[i].pos % BLOCK_SIZE;
+            off_t end = extents[i].pos + extents[i].size;
+            blocks_zero(start, extents[i].pos - start);
+            blocks_zero(end, start + BLOCK_SIZE - end);
+            extents[i].unwritten = 0;
+        }
+    }
+    for (off_t position = offset; position < endOffset;
+         position += BLOCK_SIZE - position % BLOCK_SIZE) {
+        inode_set_written(inode, position);
+    }
+
+    return count;
 }
 
 /**
@@ -182,31 +591,111 @@ int storage_write(const char *path, const char *buf, size_t size, off_t offset)
         return -1; // File not found
     }
 
-    inode_t *inode = get_inode(inodeNumber); // Get inode
+    return storage_write_inode(inodeNumber, buf, size, offset);
+}
+
+/**
+ * Writes data to the file with the given inode number, growing it as needed.
+ *
+ * @param inum Inode number of the file.
+ * @param buf Buffer containing the data to write.
+ * @param size Number of bytes to write.
+ * @param offset Offset in the file to start writing to.
+ * @return The number of bytes written, or -ENOSPC if the file cannot grow.
+ */
+int storage_write_inode(int inum, const char *buf, size_t size, off_t offset) {
 
-    int endOffset = offset + size;
-    if (endOffset > inode->size)
+    storage_iovec_t segment = { (void *) buf, size, offset };
+    return storage_writev_inode(inum, &segment, 1);
+}
+
+/**
+ * Writes data from several buffers to a file, each at its own offset.
+ *
+ * @param path Path to the file.
+ * @param iov The segments to write.
+ * @param count The number of segments.
+ * @return The total number of bytes written, -1 if the file is not found,
+ * or -ENOSPC if the file cannot grow.
+ */
+int storage_writev(const char *path, const storage_iovec_t *iov, int count) {
+
+    int inodeNumber = path_lookup(path);
+
+    if (inodeNumber <= 0)
     {
-        storage_truncate(path, endOffset); // Expand file
+        return -1;
     }
 
-    int bytesWritten = 0;
+    return storage_writev_inode(inodeNumber, iov, count);
+}
+
+/**
+ * Writes data from several buffers to the file with the given inode number,
+ * each at its own offset, growing the file as needed.
+ *
+ * The file grows once, to the end of the furthest segment, before anything
+ * is written. Segments that follow each other in the file are then mapped
+ * as one range, as storage_readv_inode does.
+ *
+ * @param inum Inode number of the file.
+ * @param iov The segments to write.
+ * @param count The number of segments.
+ * @return The total number of bytes written, or -ENOSPC if the file cannot
+ * grow (nothing is written then), or -ENOENT if it has been freed meanwhile.
+ */
+int storage_writev_inode(int inum, const storage_iovec_t *iov, int count) {
+
+    inode_t *inode = get_inode(inum);
+    int rv;
 
-    while (size > 0)
+    inode_wrlock(inum);
+    if (inode->mode == 0)
     {
-        int blockNum = inode_get_bnum(inode, offset + bytesWritten);
-        char *blockPtr = blocks_get_block(blockNum) + offset % BLOCK_SIZE;
-        int blockWriteSize = BLOCK_SIZE - offset % BLOCK_SIZE;
-        int writeSize = (size < blockWriteSize) ? size : blockWriteSize;
+        inode_unlock(inum);
+        return -ENOENT;
+    }
 
-        memcpy(blockPtr, buf + bytesWritten, writeSize);
+    // Appending after the last byte, onto a tail block that holds data
+    if (count == 1 && iov[0].len > 0 && iov[0].offset == inode->size &&
+        (inode->size % BLOCK_SIZE == 0 || !inode_is_unwritten(inode, inode->size)))
+    {
+        rv = storage_append(inode, iov[0].base, iov[0].len);
+        inode_unlock(inum);
+        return rv;
+    }
 
-        size -= writeSize;
-        bytesWritten += writeSize;
+    off_t endOffset = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        if (iov[i].len > 0 && iov[i].offset + (off_t) iov[i].len > endOffset)
+        {
+            endOffset = iov[i].offset + iov[i].len;
+        }
+    }
+    if (endOffset > inode->size && inode_extend(inode, endOffset) < 0)
+    {
+        inode_unlock(inum);
+        return -ENOSPC;
     }
 
-    return bytesWritten; // Total bytes written
+    size_t bytesWritten = 0;
 
+    for (int first = 0; first < count;)
+    {
+        size_t length;
+        int last = storage_run(iov, first, count, &length);
+
+        // Already big enough, so this only maps (and readies unwritten blocks)
+        storage_extent_t extents[length / BLOCK_SIZE + 2];
+        int mapped = storage_map_write_inode(inum, iov[first].offset, length, extents);
+
+        bytesWritten += storage_copy_run(iov + first, extents, mapped, 1);
+        first = last;
+    }
+    inode_unlock(inum);
+
+    return bytesWritten; // Total bytes written
 }
 
 
@@ -219,32 +708,227 @@ int storage_write(const char *path, const char *buf, size_t size, off_t offset)
  *
  */
 int storage_mknod(const char *path, int mode){
+    int rv = storage_create(path, mode);
+    return rv < 0 ? rv : 0;
+}
+
+/**
+ * Creates a new file or directory, like storage_mknod, and returns its inode
+ * number so the caller does not have to look it up again.
+ *
+ * @param path Path where the new file or directory should be created.
+ * @param mode The mode (permissions) for the new file or directory.
+ * @return The new inode number, or an error code on failure.
+ */
+int storage_create(const char *path, int mode){
     int inodeNumber = path_lookup(path);
     if (inodeNumber != -1)
     {
         return -EEXIST; // File already exists
     }
 
-    char parentPath[strlen(path) + 1];
     char childName[DIR_NAME_LENGTH + 1];
-    split_path(path, parentPath, childName);
-
-    int parentInodeNum = path_lookup(parentPath);
+    int parentInodeNum = storage_parent(path, childName);
     if (parentInodeNum < 0)
     {
         return -ENOENT; // Parent directory not found
     }
 
-    inode_t *parentInode = get_inode(parentInodeNum);
+    return storage_create_at(parentInodeNum, childName, mode, 0);
+}
+
+/**
+ * Creates a new file or directory in the given directory.
+ *
+ * @param dir Inode number of the directory.
+ * @param name Name of the new entry.
+ * @param mode The mode (permissions) for the new file or directory.
+ * @param pin Lookups to pin the new inode with (see inode_pin) before the
+ *            directory is unlocked, so it cannot be unlinked and freed
+ *            before the caller hands it out.
+ * @return The new inode number, or an error code on failure.
+ */
+int storage_create_at(int dir, const char *name, int mode, int pin){
+    inode_wrlock(dir);
+    int rv = storage_create_locked(dir, name, mode);
+    if (rv >= 0 && pin > 0)
+    {
+        inode_pin(rv, pin);
+    }
+    inode_unlock(dir);
+
+    return rv;
+}
+
+/**
+ * Does the work of storage_create_at, with the directory locked.
+ *
+ * @param dir Inode number of the directory.
+ * @param name Name of the new entry.
+ * @param mode The mode (permissions) for the new file or directory.
+ * @return The new inode number, or an error code on failure.
+ */
+static int storage_create_locked(int dir, const char *name, int mode){
+    inode_t *parentInode = get_inode(dir);
+    if (parentInode->mode == 0)
+    {
+        return -ENOENT; // Removed after the caller found it
+    }
+    if (!S_ISDIR(parentInode->mode))
+    {
+        return -ENOTDIR;
+    }
+    if (strlen(name) >= DIR_NAME_LENGTH)
+    {
+        return -ENAMETOOLONG;
+    }
+    if (directory_lookup(parentInode, name) >= 0)
+    {
+        return -EEXIST; // File already exists
+    }
+
     int childInodeNum = alloc_inode();
+    if (childInodeNum < 0)
+    {
+        return -ENOSPC; // No free inode
+    }
     inode_t *childInode = get_inode(childInodeNum);
+    inode_wrlock(childInodeNum);
     childInode->refs = 1;
     childInode->mode = mode;
     childInode->size = 0;
 
-    directory_put(parentInode, childName, childInodeNum);
+    if (S_ISDIR(mode)) {
+        // Directories know their parent, which is what '..' resolves to
+        childInode->parent = dir;
+
+        // Directories created in an ordered directory are ordered too
+        if (parentInode->flags & INODE_ORDERED) {
+            childInode->flags |= INODE_ORDERED;
+        }
+    }
+
+    int rv = directory_put(parentInode, name, childInodeNum);
+    if (rv < 0)
+    {
+        free_inode(childInodeNum); // No room for the entry
+    }
+    inode_unlock(childInodeNum);
 
-    return 0; // Success
+    return rv < 0 ? rv : childInodeNum;
+}
+
+/**
+ * Creates several files in one directory at once, as when extracting an
+ * archive.
+ *
+ * Each file gets its inode and all of its blocks in one go, and the entries
+ * are added in a single directory update.
+ *
+ * @param dir Inode number of the directory to create the files in.
+ * @param files The files to create.
+ * @param count The number of files.
+ * @return The number of files created, which is less than count if one of
+ *         them could not be, or an error code if none was.
+ */
+int storage_create_batch(int dir, const storage_create_t *files, int count)
+{
+    inode_wrlock(dir);
+    int rv = storage_create_batch_locked(dir, files, count);
+    inode_unlock(dir);
+
+    return rv;
+}
+
+/**
+ * Does the work of storage_create_batch, with the directory locked.
+ *
+ * @param dir Inode number of the directory to create the files in.
+ * @param files The files to create.
+ * @param count The number of files.
+ * @return The number of files created, or an error code if none was.
+ */
+static int storage_create_batch_locked(int dir, const storage_create_t *files, int count)
+{
+    inode_t *parentInode = get_inode(dir);
+    if (parentInode->mode == 0)
+    {
+        return -ENOENT; // Removed after the caller found it
+    }
+    if (!S_ISDIR(parentInode->mode))
+    {
+        return -ENOTDIR;
+    }
+
+    dirent_t *entries = calloc(count ? count : 1, sizeof(dirent_t));
+    int rv = 0;
+    int done;
+
+    for (done = 0; done < count; ++done)
+    {
+        const storage_create_t *file = &files[done];
+        size_t length = strlen(file->name);
+
+        if (length == 0 || length >= DIR_NAME_LENGTH || strchr(file->name, '/') ||
+            !S_ISREG(file->mode))
+        {
+            rv = -EINVAL;
+            break;
+        }
+
+        // Neither in the directory nor earlier in this batch
+        int exists = directory_lookup(parentInode, file->name) >= 0;
+        for (int i = 0; i < done && !exists; ++i)
+        {
+            exists = !strcmp(entries[i].name, file->name);
+        }
+        if (exists)
+        {
+            rv = -EEXIST;
+            break;
+        }
+
+        int inum = alloc_inode();
+        if (inum < 0)
+        {
+            rv = -ENOSPC;
+            break;
+        }
+
+        inode_t *node = get_inode(inum);
+        inode_wrlock(inum);
+        node->mode = file->mode;
+        if (grow_inode(node, file->size) < 0)
+        {
+            free_inode(inum);
+            inode_unlock(inum);
+            rv = -ENOSPC;
+            break;
+        }
+        storage_fill(node, file->data, file->size);
+        inode_unlock(inum);
+
+        memcpy(entries[done].name, file->name, length + 1);
+        entries[done].inum = inum;
+        entries[done].input_allocation = 1;
+        entries[done].type = DIRENT_TYPE(file->mode);
+    }
+
+    int added = directory_put_batch(parentInode, entries, done);
+    if (added < 0)
+    {
+        rv = added;
+        added = 0;
+    }
+
+    // Files the directory had no room for
+    for (int i = added; i < done; ++i)
+    {
+        free_inode(entries[i].inum);
+    }
+    free(entries);
+
+    return added ? added : rv;
 }
 
 /**
@@ -256,23 +940,163 @@ int storage_mknod(const char *path, int mode){
  */
 int storage_unlink(const char *path){
 
-    char parentPath[strlen(path) + 1];
     char fileName[DIR_NAME_LENGTH + 1];
-    split_path(path, parentPath, fileName);
+    int parentInodeNum = storage_parent(path, fileName);
+    if (parentInodeNum < 0)
+    {
+        return -ENOENT; // Parent directory not found
+    }
 
-    int parentInodeNum = path_lookup(parentPath);
-    inode_t *parentInode = get_inode(parentInodeNum);
+    return storage_unlink_at(parentInodeNum, fileName);
+}
 
-    int unlinkResult = directory_delete(parentInode, fileName);
+/**
+ * Unlinks an entry of the given directory.
+ *
+ * @param dir Inode number of the directory.
+ * @param name Name of the entry to remove.
+ * @return 0 on success, or an error code on failure.
+ */
+int storage_unlink_at(int dir, const char *name){
+    inode_t *parentInode = get_inode(dir);
+
+    inode_wrlock(dir);
+    int inodeNumber = storage_lock_entry(parentInode, name);
+    if (inodeNumber < 0)
+    {
+        inode_unlock(dir);
+        return -ENOENT;
+    }
+
+    int rv = directory_delete(parentInode, name); // Result of unlink operation
+    inode_unlock(inodeNumber);
+    inode_unlock(dir);
+
+    return rv;
+}
+
+/**
+ * Removes an empty directory.
+ *
+ * @param path Path to the directory to be removed.
+ * @return 0 on success, or an error code on failure.
+ *
+ */
+int storage_rmdir(const char *path){
+
+    char dirName[DIR_NAME_LENGTH + 1];
+    int parentInodeNum = storage_parent(path, dirName);
+    if (parentInodeNum < 0)
+    {
+        return -ENOENT; // Parent directory not found
+    }
 
-    return unlinkResult; // Result of unlink operation
+    return storage_rmdir_at(parentInodeNum, dirName);
+}
+
+/**
+ * Removes an empty directory from the given directory.
+ *
+ * @param dir Inode number of the parent directory.
+ * @param name Name of the directory to remove.
+ * @return 0 on success, or an error code on failure.
+ */
+int storage_rmdir_at(int dir, const char *name){
+    inode_t *parentInode = get_inode(dir);
+
+    if (name[0] == 0)
+    {
+        return -EBUSY; // The root stays
+    }
+
+    inode_wrlock(dir);
+    int inodeNumber = storage_lock_entry(parentInode, name);
+    if (inodeNumber < 0)
+    {
+        inode_unlock(dir);
+        return -ENOENT; // Directory not found
+    }
+
+    inode_t *inode = get_inode(inodeNumber);
+    int rv;
+    if (!S_ISDIR(inode->mode))
+    {
+        rv = -ENOTDIR;
+    }
+    else if (!directory_empty(inode))
+    {
+        // The inode counts its entries, no need to look at them
+        rv = -ENOTEMPTY;
+    }
+    else
+    {
+        rv = directory_delete(parentInode, name);
+    }
+
+    inode_unlock(inodeNumber);
+    inode_unlock(dir);
+    return rv;
+}
+
+/**
+ * Removes a file or a directory together with everything below it.
+ *
+ * @param path The path of the file or directory to remove.
+ * @return 0 on success, or an error code on failure.
+ */
+int storage_rmtree(const char *path)
+{
+    char name[DIR_NAME_LENGTH + 1];
+    int parentInodeNum = storage_parent(path, name);
+    if (parentInodeNum < 0)
+    {
+        return -ENOENT;
+    }
+
+    return storage_rmtree_at(parentInodeNum, name);
+}
+
+/**
+ * Removes an entry of the given directory together with everything below it.
+ *
+ * The bitmap bits of all the freed blocks and inodes are cleared in one
+ * batch once the walk is done.
+ *
+ * @param dir Inode number of the directory.
+ * @param name Name of the entry to remove.
+ * @return 0 on success, or an error code on failure.
+ */
+int storage_rmtree_at(int dir, const char *name)
+{
+    inode_t *parentInode = get_inode(dir);
+
+    if (name[0] == 0 || !strcmp(name, ".."))
+    {
+        return -EBUSY; // The root and the parent stay
+    }
+
+    inode_wrlock(dir);
+    int inodeNumber = storage_lock_entry(parentInode, name);
+    if (inodeNumber < 0)
+    {
+        inode_unlock(dir);
+        return -ENOENT;
+    }
+
+    blocks_batch_begin();
+    int rv = directory_delete_tree(parentInode, name);
+    blocks_batch_end();
+
+    inode_unlock(inodeNumber);
+    inode_unlock(dir);
+    return rv;
 }
 
 /**
  * Creates a link (hard link) to a file.
  *
- * @param from The path of the target file.
- * @param to The path of the link to create.
+ * @param from The path of the link to create.
+ * @param to The path of the target file.
  * @return 0 on success, or an error code on failure.
  *
  */
@@ -280,42 +1104,352 @@ int storage_link(const char *from, const char *to){
     int toInodeNum = path_lookup(to);
     if (toInodeNum < 0)
     {
-        return -1; // 'to' path not found
+        return -ENOENT; // 'to' path not found
     }
 
-    inode_t *toInode = get_inode(toInodeNum);
-
-    char parentPath[strlen(from) + 1];
     char fileName[DIR_NAME_LENGTH + 1];
-    split_path(from, parentPath, fileName);
+    int parentInodeNum = storage_parent(from, fileName);
+    if (parentInodeNum < 0)
+    {
+        return -ENOENT; // Parent directory not found
+    }
 
-    int parentInodeNum = path_lookup(parentPath);
-    inode_t *parentInode = get_inode(parentInodeNum);
+    return storage_link_at(toInodeNum, parentInodeNum, fileName, 0);
+}
 
-    directory_put(parentInode, fileName, toInodeNum);
-    toInode->refs++;
+/**
+ * Adds another name for a file to the given directory.
+ *
+ * @param inum Inode number of the file.
+ * @param dir Inode number of the directory.
+ * @param name Name of the new link.
+ * @param pin Lookups to pin the file with (see inode_pin) before the
+ *            directory is unlocked.
+ * @return 0 on success, or an error code on failure.
+ */
+int storage_link_at(int inum, int dir, const char *name, int pin){
+    inode_t *parentInode = get_inode(dir);
+    if (strlen(name) >= DIR_NAME_LENGTH)
+    {
+        return -ENAMETOOLONG;
+    }
 
-    return 0; // Success
+    inode_wrlock(dir);
+    int rv = -EEXIST;
+    if (!S_ISDIR(parentInode->mode))
+    {
+        rv = -ENOENT; // Removed after the caller found it
+    }
+    else if (directory_lookup(parentInode, name) < 0)
+    {
+        // Locked after the directory it is linked into, see inode.h
+        inode_wrlock(inum);
+        if (get_inode(inum)->mode == 0)
+        {
+            rv = -ENOENT;
+        }
+        else
+        {
+            rv = directory_put(parentInode, name, inum);
+        }
+        if (rv == 0)
+        {
+            get_inode(inum)->refs++;
+            if (pin > 0)
+            {
+                inode_pin(inum, pin);
+            }
+        }
+        inode_unlock(inum);
+    }
+    inode_unlock(dir);
 
+    return rv;
 }
 
 /**
  * Renames or moves a file or directory.
  *
+ * Each parent directory is resolved once and the entry is moved in a single
+ * directory operation, see storage_rename_at.
+ *
  * @param from The current path of the file or directory.
  * @param to The new path of the file or directory.
+ * @param flags RENAME_NOREPLACE, RENAME_EXCHANGE or 0.
  * @return 0 on success, or an error code on failure.
  *
  */
-int storage_rename(const char *from, const char *to) {
-    int linkResult = storage_link(to, from);
-    if (linkResult != 0) {
-        return linkResult; // Error in creating link
+int storage_rename(const char *from, const char *to, unsigned int flags) {
+    char fromParentPath[strlen(from) + 1];
+    char fromName[DIR_NAME_LENGTH + 1];
+    split_path(from, fromParentPath, fromName);
+
+    char toParentPath[strlen(to) + 1];
+    char toName[DIR_NAME_LENGTH + 1];
+    split_path(to, toParentPath, toName);
+
+    int fromParentNum = path_lookup(fromParentPath);
+    int toParentNum = strcmp(fromParentPath, toParentPath) == 0
+        ? fromParentNum
+        : path_lookup(toParentPath);
+    if (fromParentNum < 0 || toParentNum < 0)
+    {
+        return -ENOENT; // Parent directory not found
+    }
+
+    return storage_rename_at(fromParentNum, fromName, toParentNum, toName, flags);
+}
+
+/**
+ * Moves an entry between (or within) directories given by inode number,
+ * see directory_rename.
+ *
+ * @param fromDir Inode number of the directory holding the entry.
+ * @param from The current name of the entry.
+ * @param toDir Inode number of the directory to move it to.
+ * @param to The new name of the entry.
+ * @param flags RENAME_NOREPLACE, RENAME_EXCHANGE or 0.
+ * @return 0 on success, or an error code on failure.
+ */
+int storage_rename_at(int fromDir, const char *from, int toDir, const char *to,
+                      unsigned int flags) {
+    if (fromDir != toDir)
+    {
+        pthread_mutex_lock(&storage_rename_lock);
+    }
+
+    // Both directories: one inside the other first, else in inode number
+    // order. Parents only change under the rename lock, so this holds.
+    int first = fromDir < toDir ? fromDir : toDir;
+    int second = fromDir < toDir ? toDir : fromDir;
+    if (second != first && storage_is_ancestor(second, first))
+    {
+        second = first;
+        first = fromDir == second ? toDir : fromDir;
+    }
+    inode_wrlock(first);
+    if (second != first)
+    {
+        inode_wrlock(second);
+    }
+
+    int rv = storage_rename_locked(fromDir, from, toDir, to, flags);
+
+    if (second != first)
+    {
+        inode_unlock(second);
+        pthread_mutex_unlock(&storage_rename_lock);
+    }
+    inode_unlock(first);
+
+    return rv;
+}
+
+/**
+ * Does the work of storage_rename_at, with both directories locked. Locks
+ * the entries being moved or replaced itself.
+ *
+ * @param fromDir Inode number of the directory holding the entry.
+ * @param from The current name of the entry.
+ * @param toDir Inode number of the directory to move it to.
+ * @param to The new name of the entry.
+ * @param flags RENAME_NOREPLACE, RENAME_EXCHANGE or 0.
+ * @return 0 on success, or an error code on failure.
+ */
+static int storage_rename_locked(int fromDir, const char *from, int toDir, const char *to,
+                                 unsigned int flags) {
+    inode_t *fromParent = get_inode(fromDir);
+    inode_t *toParent = get_inode(toDir);
+
+    if (strlen(to) >= DIR_NAME_LENGTH)
+    {
+        return -ENAMETOOLONG;
+    }
+
+    // Either directory may have been removed after the caller found it
+    if (!S_ISDIR(fromParent->mode) || !S_ISDIR(toParent->mode))
+    {
+        return -ENOENT;
+    }
+
+    // Neither names an entry that could be locked after the directories
+    if (!from[0] || !to[0] || !strcmp(from, "..") || !strcmp(to, ".."))
+    {
+        return -EINVAL;
+    }
+
+    // A directory cannot move into its own subtree, nor be replaced by
+    // something from inside it, which would leave it not empty (parents
+    // only change under the rename lock, which is held if they differ)
+    int fromInodeNum = directory_lookup(fromParent, from);
+    int toInodeNum = directory_lookup(toParent, to);
+    if (fromDir != toDir && storage_is_ancestor(fromInodeNum, toDir))
+    {
+        return -EINVAL;
+    }
+    if (fromDir != toDir && storage_is_ancestor(toInodeNum, fromDir))
+    {
+        if (flags & RENAME_EXCHANGE)
+        {
+            return -EINVAL;
+        }
+        return (flags & RENAME_NOREPLACE) ? -EEXIST : -ENOTEMPTY;
+    }
+
+    // The entries moved or replaced: directories first, then by number
+    int first = fromInodeNum;
+    int second = toInodeNum;
+    if (second >= 0 && (first < 0 || storage_lock_before(second, first)))
+    {
+        first = toInodeNum;
+        second = fromInodeNum;
+    }
+    if (first >= 0)
+    {
+        inode_wrlock(first);
+    }
+    if (second >= 0 && second != first)
+    {
+        inode_wrlock(second);
     }
 
-    int unlinkResult = storage_unlink(from);
-    return unlinkResult; // Result of unlink operation
+    int rv = directory_rename(fromParent, from, toParent, to, flags);
+    if (rv == 0 && fromDir != toDir)
+    {
+        // Directories that changed parent point back at the new one
+        inode_t *moved = get_inode(fromInodeNum);
+        if (S_ISDIR(moved->mode))
+        {
+            moved->parent = toDir;
+        }
+        if ((flags & RENAME_EXCHANGE) && S_ISDIR(get_inode(toInodeNum)->mode))
+        {
+            get_inode(toInodeNum)->parent = fromDir;
+        }
+    }
+
+    if (second >= 0 && second != first)
+    {
+        inode_unlock(second);
+    }
+    if (first >= 0)
+    {
+        inode_unlock(first);
+    }
+
+    return rv;
+}
+
+/**
+ * Tells which of two entries of locked directories to lock first: a
+ * directory before anything else, else the lower inode number. See inode.h.
+ *
+ * @param a An inode number.
+ * @param b Another inode number.
+ * @return 1 if a is locked before b, 0 otherwise.
+ */
+static int storage_lock_before(int a, int b)
+{
+    int aDir = S_ISDIR(get_inode(a)->mode);
+    int bDir = S_ISDIR(get_inode(b)->mode);
+
+    return aDir != bDir ? aDir : a < b;
+}
+
+/**
+ * Looks up an entry of a directory the caller has write-locked, and
+ * write-locks the inode it refers to, as unlinking it requires.
+ *
+ * @param dir Pointer to the inode of the directory.
+ * @param name The name of the entry.
+ * @return The inode number, locked, or -1 if there is no such entry. The
+ *         empty name and '..' never name an entry here.
+ */
+static int storage_lock_entry(inode_t *dir, const char *name)
+{
+    // The directory may have been removed after the caller found it
+    if (!S_ISDIR(dir->mode) || name[0] == 0 || !strcmp(name, ".."))
+    {
+        return -1;
+    }
+
+    int inodeNumber = directory_lookup(dir, name);
+    if (inodeNumber >= 0)
+    {
+        inode_wrlock(inodeNumber);
+    }
+
+    return inodeNumber;
+}
+
+/**
+ * Copies data into the start of a file whose blocks are already allocated,
+ * zeroing the rest of the last block, and marks the blocks written.
+ *
+ * @param node The inode of the file.
+ * @param data The data to copy.
+ * @param size The number of bytes to copy.
+ */
+static void storage_fill(inode_t *node, const char *data, size_t size)
+{
+    for (size_t done = 0; done < size; done += BLOCK_SIZE)
+    {
+        size_t chunk = size - done < BLOCK_SIZE ? size - done : BLOCK_SIZE;
+        off_t pos = (off_t) inode_get_bnum(node, done) * BLOCK_SIZE;
+        blocks_write(pos, data + done, chunk);
+        blocks_zero(pos + chunk, BLOCK_SIZE - chunk);
+        inode_set_written(node, done);
+    }
+}
+
+/**
+ * Checks whether a directory is the given directory or one of its ancestors.
+ *
+ * Follows the stored parent numbers up to the root, without locking: they
+ * only change under the rename lock while the directories are in the tree.
+ * A directory removed meanwhile may leave a stale chain, so the walk stops
+ * after as many steps as there are inodes; the rename then finds it gone
+ * once it has the directories locked.
+ *
+ * @param ancestor The inode number to look for, or -1.
+ * @param inum The directory to start from.
+ * @return 1 if ancestor is on the way from inum to the root, 0 otherwise.
+ */
+static int storage_is_ancestor(int ancestor, int inum) {
+    if (ancestor <= 0 || !S_ISDIR(get_inode(ancestor)->mode))
+    {
+        return 0;
+    }
+
+    for (int steps = 0; steps < BLOCK_COUNT; ++steps)
+    {
+        if (inum == ancestor)
+        {
+            return 1;
+        }
+        if (inum == 0)
+        {
+            return 0;
+        }
+        inum = get_inode(inum)->parent;
+    }
+
+    return 0;
+}
+
+/**
+ * Resolves the directory that holds the last component of a path.
+ *
+ * @param path Full path of the file or directory.
+ * @param name Buffer (DIR_NAME_LENGTH + 1 bytes) for the last component.
+ * @return The inode number of the directory, or -1 if it does not exist.
+ */
+static int storage_parent(const char *path, char *name)
+{
+    char parentPath[strlen(path) + 1];
+    split_path(path, parentPath, name);
 
+    return path_lookup(parentPath);
 }
 
 /**
@@ -14,15 +14,72 @@
 
 #include "slist.h"
 
-void storage_init(const char *path);
+// One file to create with storage_create_batch
+typedef struct storage_create {
+  const char *name; // entry name, not a path
+  int mode;         // a regular file mode
+  size_t size;      // file size
+  const char *data; // size bytes of contents
+} storage_create_t;
+
+// A run of a file that lies contiguously in the disk image
+typedef struct storage_extent {
+  off_t pos;     // byte offset in the image file
+  size_t size;   // length in bytes
+  int unwritten; // never written: reads as zeros, not from pos
+} storage_extent_t;
+
+// One segment of a vectored read or write
+typedef struct storage_iovec {
+  void *base;   // the caller's buffer
+  size_t len;   // its length in bytes
+  off_t offset; // where in the file it is read from or written to
+} storage_iovec_t;
+
+// Readahead state of one open file, all zero to start with
+typedef struct storage_readahead {
+  off_t next;    // where a sequential read would continue
+  off_t ahead;   // end of what has been prefetched
+  size_t window; // bytes to stay ahead of the reader, 0 when not sequential
+} storage_readahead_t;
+
+// Readahead window bounds
+#define STORAGE_READAHEAD_MIN (4 * 4096)
+#define STORAGE_READAHEAD_MAX (64 * 4096)
+
+int storage_init(const char *path);
 int storage_stat(const char *path, struct stat *st);
+int storage_stat_inode(int inum, struct stat *st);
 int storage_read(const char *path, char *buf, size_t size, off_t offset);
+int storage_read_inode(int inum, char *buf, size_t size, off_t offset);
+int storage_readv(const char *path, const storage_iovec_t *iov, int count);
+int storage_readv_inode(int inum, const storage_iovec_t *iov, int count);
+int storage_map_inode(int inum, off_t offset, size_t size, storage_extent_t *extents);
+int storage_map_write_inode(int inum, off_t offset, size_t size, storage_extent_t *extents);
+void storage_readahead(int inum, storage_readahead_t *ra, off_t offset, size_t size);
 int storage_write(const char *path, const char *buf, size_t size, off_t offset);
+int storage_write_inode(int inum, const char *buf, size_t size, off_t offset);
+int storage_writev(const char *path, const storage_iovec_t *iov, int count);
+int storage_writev_inode(int inum, const storage_iovec_t *iov, int count);
 int storage_truncate(const char *path, off_t size);
+int storage_truncate_inode(int inum, off_t size);
 int storage_mknod(const char *path, int mode);
+int storage_create(const char *path, int mode);
 int storage_unlink(const char *path);
+int storage_rmdir(const char *path);
+int storage_rmtree(const char *path);
 int storage_link(const char *from, const char *to);
-int storage_rename(const char *from, const char *to);
+int storage_rename(const char *from, const char *to, unsigned int flags);
+
+// The same operations on an entry of a directory given by inode number
+int storage_create_at(int dir, const char *name, int mode, int pin);
+int storage_create_batch(int dir, const storage_create_t *files, int count);
+int storage_unlink_at(int dir, const char *name);
+int storage_rmdir_at(int dir, const char *name);
+int storage_rmtree_at(int dir, const char *name);
+int storage_link_at(int inum, int dir, const char *name, int pin);
+int storage_rename_at(int fromDir, const char *from, int toDir, const char *to,
+                      unsigned int flags);
 int storage_set_time(const char *path, const struct timespec ts[2]);
 slist_t *storage_list(const char *path);
 
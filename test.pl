@@ -2,16 +2,31 @@
 use 5.16.0;
 use warnings FATAL => 'all';
 
-use Test::Simple tests => 31;
+use Test::Simple tests => 54;
 use IO::Handle;
+use Fcntl;
+
+# Other builds to test, as variables for make, e.g. perl test.pl bcache
+my %builds = (
+    bcache => "CPPFLAGS=-DNUFS_BCACHE",
+    lowlevel => q{CPPFLAGS="-DFUSE_USE_VERSION=30 -DNUFS_LOWLEVEL $(pkg-config fuse3 --cflags)"} .
+                q{ LDLIBS="$(pkg-config fuse3 --libs) -lbsd -lpthread"},
+);
+my $build = "";
+if (@ARGV) {
+    $build = $builds{$ARGV[0]}
+        // die "usage: $0 [" . join("|", sort keys %builds) . "]\n";
+    # Objects built with other flags would be reused otherwise
+    system("make clean >/dev/null 2>&1");
+}
 
 sub mount {
-    system("(make mount 2>&1) >> test.log &");
+    system("(make $build mount 2>&1) >> test.log &");
     sleep 1;
 }
 
 sub unmount {
-    system("(make unmount 2>&1) >> test.log");
+    system("(make $build unmount 2>&1) >> test.log");
 }
 
 sub write_text {
@@ -41,6 +56,73 @@ sub read_text_slice {
     return $data;
 }
 
+sub touch {
+    my ($name) = @_;
+    open my $fh, ">", "mnt/$name" or return;
+    close $fh;
+}
+
+# ioctls from nufs_ioctl.h, numbered the way <sys/ioctl.h> does on Linux
+sub nufs_ioc {
+    my ($dir, $nr, $size) = @_;
+    return ($dir << 30) | ($size << 16) | (ord("N") << 8) | $nr;
+}
+
+my $NAME_MAX = 48;     # NUFS_NAME_MAX
+my $RANGE_MAX = 32;    # NUFS_RANGE_MAX
+my $BATCH_MAX = 16;    # NUFS_BATCH_MAX
+my $BATCH_DATA = 8192; # NUFS_BATCH_DATA
+
+my $IOC_SET_ORDERED = nufs_ioc(0, 1, 0);
+my $IOC_LIST_RANGE = nufs_ioc(3, 2, 3 * $NAME_MAX + 4 + $RANGE_MAX * ($NAME_MAX + 8));
+my $IOC_RMTREE = nufs_ioc(1, 3, $NAME_MAX);
+my $IOC_CREATE_BATCH = nufs_ioc(3, 4, 8 + $BATCH_MAX * ($NAME_MAX + 12) + $BATCH_DATA);
+
+# Issue an ioctl on a directory; the argument is updated in place. Returns
+# false with the error in $! on failure.
+sub dir_ioctl {
+    my ($dir, $cmd) = @_;
+    sysopen my $fh, "mnt/$dir", O_RDONLY | O_DIRECTORY or return;
+    my $rv = ioctl($fh, $cmd, $_[2]);
+    my $err = $!;
+    close $fh;
+    $! = $err;
+    return $rv;
+}
+
+# One NUFS_IOC_LIST_RANGE call: the names, or undef on failure.
+sub list_range {
+    my ($dir, $after, $before, $prefix) = @_;
+    my $arg = pack("(Z$NAME_MAX)3 L", $after, $before, $prefix, 0) .
+              ("\0" x ($RANGE_MAX * ($NAME_MAX + 8)));
+    dir_ioctl($dir, $IOC_LIST_RANGE, $arg) or return;
+    my $count = unpack("x[(Z$NAME_MAX)3] L", $arg);
+    return [unpack("x[(Z$NAME_MAX)3 L] (Z$NAME_MAX x8)$count", $arg)];
+}
+
+# A NUFS_IOC_CREATE_BATCH argument for [name, size, offset] entries into
+# the data, all regular files.
+sub create_batch {
+    my ($data, @entries) = @_;
+    my $arg = pack("L L", scalar @entries, 0);
+    $arg .= pack("Z$NAME_MAX L L L", $_->[0], 0100644, $_->[1], $_->[2]) for @entries;
+    $arg .= "\0" x (($BATCH_MAX - @entries) * ($NAME_MAX + 12));
+    return $arg . pack("a$BATCH_DATA", $data);
+}
+
+# Every name with the prefix, a page of NUFS_RANGE_MAX at a time.
+sub list_pages {
+    my ($dir, $prefix) = @_;
+    my @names;
+    my $after = "";
+    while (my $page = list_range($dir, $after, "", $prefix)) {
+        push @names, @$page;
+        return @names if @$page < $RANGE_MAX;
+        $after = $page->[-1];
+    }
+    return;
+}
+
 system("rm -f data.nufs test.log");
 
 say "#           == Basic Tests ==";
@@ -121,6 +203,8 @@ ok(($files =~ /foo/ and $files =~ /tmp/), "Directories listed");
 
 ok((mkdir("mnt/foo/bar") and -d "mnt/foo/bar"), "Create a nested directory");
 ok((mkdir("mnt/foo/bar/baz") and -d "mnt/foo/bar/baz"), "Create a nested-nested directory");
+ok(!rmdir("mnt/foo/bar"), "Non-empty directory is not removed");
+ok((rmdir("mnt/foo/bar/baz") and !-e "mnt/foo/bar/baz"), "Remove an empty directory");
 
 my $msg4 = "This is a file";
 write_text("tmp/file.txt", $msg4);
@@ -132,6 +216,12 @@ ok(-e "mnt/foo/file.txt", "Move a file to another directory");
 my $msg6 = read_text("foo/file.txt");
 ok($msg4 eq $msg6, "Read data back correctly");
 
+write_text("tmp/old.txt", "old");
+write_text("tmp/new.txt", "new");
+system("mv -f mnt/tmp/new.txt mnt/tmp/old.txt");
+ok((!-e "mnt/tmp/new.txt" and read_text("tmp/old.txt") eq "new"),
+   "Rename over an existing file");
+
 unmount();
 
 system("rm -f data.nufs test.log");
@@ -170,6 +260,120 @@ $has_size = $size eq 16 * $chunks + 1;
 ok(($listed and $exists and $has_size), "Larger file exists and has the correct size");
 $back = read_text("larger.txt");
 ok($content eq $back, "Read back data from larger file correctly");
+$back = read_text_slice("larger.txt", 12, 4090);
+ok($back eq "6_7_8_1_2_3_", "Read across a block boundary");
+
+unlink("mnt/larger.txt");
+write_text("holes.txt", "");
+truncate("mnt/holes.txt", 20000);
+$back = read_text_slice("holes.txt", 12, 4090);
+ok($back eq ("\0" x 12), "Extended file reads as zeros, not old data");
+
+open my $open, ">", "mnt/open.txt";
+syswrite($open, "abc_") for 1 .. 10;
+$files = `ls -l mnt`;
+ok((-s "mnt/open.txt" == 40 and $files =~ /\s40\s.*open\.txt/),
+   "Small writes count in the size before close");
+ok(read_text("open.txt") eq ("abc_" x 10), "Small writes read back before close");
+close $open;
+
+unmount();
+
+system("rm -f data.nufs test.log");
+
+mount();
+
+say "# Ordered directories";
+
+my $no_arg = 0;
+ok((mkdir("mnt/ord") and dir_ioctl("ord", $IOC_SET_ORDERED, $no_arg)),
+   "Make an ordered directory");
+
+# Long names, for several B+tree leaves and several readdir requests
+my @names = map { sprintf("entry-%03d-", $_) . ("x" x 30) } 0 .. 149;
+touch("ord/" . $names[($_ * 67) % 150]) for 0 .. 149;
+
+opendir my $dh, "mnt/ord";
+my @listed = grep { !/^\.\.?$/ } readdir $dh;
+ok("@listed" eq "@names", "readdir lists an ordered directory in name order");
+
+my @paged = list_pages("ord", "");
+ok("@paged" eq "@names", "Range listing pages through every name in order");
+my $range = list_range("ord", $names[10], $names[15], "");
+ok(($range and "@$range" eq "@names[11 .. 14]"), "Range listing between two names");
+$range = list_range("ord", "", "", "entry-05");
+ok(($range and "@$range" eq "@names[50 .. 59]"), "Range listing by prefix");
+
+rewinddir $dh;
+readdir $dh for 1 .. 62; # '.', '..' and 60 names
+my $pos = telldir $dh;
+my @tail = readdir $dh;
+seekdir $dh, $pos;
+my @again = readdir $dh;
+ok(("@tail" eq "@names[60 .. 149]" and "@again" eq "@tail"),
+   "seekdir resumes an ordered listing");
+
+# Names added before the position or removed after it while listing
+rewinddir $dh;
+readdir $dh for 1 .. 62;
+touch("ord/a-new-name");
+unlink("mnt/ord/$names[149]");
+@tail = readdir $dh;
+ok("@tail" eq "@names[60 .. 148]", "A listing resumes after the last name it returned");
+closedir $dh;
+
+unmount();
+
+system("rm -f data.nufs test.log");
+
+mount();
+
+say "# Deleting a subtree";
+
+mkdir("mnt/tree");
+mkdir("mnt/tree/$_") for qw(a a/b a/b/c d);
+write_text("tree/$_", "in $_") for qw(top.txt a/one.txt a/b/two.txt a/b/c/three.txt);
+write_text("tree/a/b/c/linked.txt", "kept");
+link("mnt/tree/a/b/c/linked.txt", "mnt/kept.txt");
+
+my $target = pack("Z$NAME_MAX", "tree");
+ok(dir_ioctl(".", $IOC_RMTREE, $target), "Delete a nested tree in one call");
+$files = `ls mnt`;
+ok((!-e "mnt/tree" and $files !~ /tree/), "The tree is gone");
+ok((read_text("kept.txt") eq "kept" and (stat "mnt/kept.txt")[3] == 1),
+   "A file linked from outside the tree survives");
+ok((!dir_ioctl(".", $IOC_RMTREE, $target) and $!{ENOENT}),
+   "Deleting a missing tree fails");
 
-unmount()
+unmount();
+
+system("rm -f data.nufs test.log");
+
+mount();
+
+say "# Creating files in a batch";
+
+mkdir("mnt/batch");
+my $data = "alpha" . ("beta-" x 1000) . "gamma";
+my $batch = create_batch($data, ["one.txt", 5, 0], ["two.txt", 5000, 5],
+                         ["three.txt", 5, 5005]);
+ok((dir_ioctl("batch", $IOC_CREATE_BATCH, $batch) and unpack("x4 L", $batch) == 3),
+   "Create three files in one call");
+ok((read_text("batch/one.txt") eq "alpha" and read_text("batch/two.txt") eq ("beta-" x 1000)
+    and read_text("batch/three.txt") eq "gamma"), "Read back the batch's files");
+
+$batch = create_batch($data, ["past.txt", 500, $BATCH_DATA - 100]);
+ok((!dir_ioctl("batch", $IOC_CREATE_BATCH, $batch) and $!{EINVAL} and !-e "mnt/batch/past.txt"),
+   "Contents past the end of the data are refused");
+
+$batch = create_batch($data, ["one.txt", 5, 0]);
+ok((!dir_ioctl("batch", $IOC_CREATE_BATCH, $batch) and $!{EEXIST}),
+   "An existing name is refused");
+$batch = create_batch($data, ["four.txt", 5, 0], ["one.txt", 5, 0]);
+ok((dir_ioctl("batch", $IOC_CREATE_BATCH, $batch) and unpack("x4 L", $batch) == 1
+    and read_text("batch/four.txt") eq "alpha"), "A batch stops at an existing name");
+
+unmount();
 
+# Leave no objects of another build behind for the next plain run
+system("make clean >/dev/null 2>&1") if $build;